@@ -0,0 +1,92 @@
+/******************************************************************************
+ *
+ *  File Name........: parse_allocs.c
+ *
+ *  Description......:
+ *	Allocation count benchmark for the parser.  Writes a generated
+ *  script to a temporary file, parses it with parse()/freePipe() and
+ *  counts the calls parse.c makes to malloc and realloc (the program is
+ *  linked with --wrap=malloc --wrap=realloc).  The first lines warm the
+ *  arena up, after that every line should parse without a malloc.
+ *
+ *  usage: parse_allocs [lines]
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../parse.h"
+
+#define WARMUP 1000
+
+static long allocs = 0;
+
+void *__real_malloc(size_t);
+void *__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocs++;
+  return __real_realloc(p, size);
+}
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses count lines, returns the number of pipe lists
+static long parse_lines(long count) {
+  long pipes = 0, i;
+  Pipe p;
+
+  for(i = 0; i < count; i++) {
+    p = parse();
+    if(p == NULL)
+      continue;
+    pipes++;
+    freePipe(p);
+  }
+  return pipes;
+}
+
+int main(int argc, char *argv[]) {
+  long lines = argc > 1 ? atol(argv[1]) : 100000;
+  char path[] = "/tmp/ush_parse_allocsXXXXXX";
+  FILE *script;
+  long i, pipes;
+  double start;
+  int fd;
+
+  fd = mkstemp(path);
+  script = fdopen(fd, "w");
+  for(i = 0; i < WARMUP + lines; i++)
+    fprintf(script, "ls -l /usr/lib/file%ld \"quoted arg\" | grep -v x%ld |& wc -l >> /tmp/out ; echo %ld &\n",
+            i, i, i);
+  fflush(script);
+  lseek(fd, 0, SEEK_SET);
+  setParseInput(fd);
+
+  parse_lines(WARMUP);
+
+  allocs = 0;
+  start = now();
+  pipes = parse_lines(lines);
+  printf("%ld lines, %ld pipe lists, %ld allocations (%.4f per line), %.0f ns per line\n",
+         lines, pipes, allocs, (double)allocs / lines, (now() - start) * 1e9 / lines);
+
+  fclose(script);
+  unlink(path);
+  return 0;
+}
+
+/*........................ end of parse_allocs.c ............................*/
@@ -0,0 +1,63 @@
+/******************************************************************************
+ *
+ *  File Name........: parse_script.c
+ *
+ *  Description......:
+ *	Parser speed benchmark.  Parses a script with parse()/freePipe()
+ *  without running anything, the way sh -n does, and prints the number
+ *  of lines and the time it took.  bench/run.sh compares it with sh -n
+ *  on the same generated script.
+ *
+ *  usage: parse_script file
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "../parse.h"
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  long lines = 0;
+  double start;
+  Pipe p;
+  int fd;
+
+  if(argc != 2) {
+    fprintf(stderr, "usage: %s file\n", argv[0]);
+    return 1;
+  }
+  fd = open(argv[1], O_RDONLY);
+  if(fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  setParseInput(fd);
+
+  start = now();
+  while(1) {
+    p = parse();
+    if(p == NULL)
+      continue;
+    if(!strcmp(p -> head -> args[0], "end")) {
+      freePipe(p);
+      break;
+    }
+    lines++;
+    freePipe(p);
+  }
+  printf("%ld lines %.0f ms\n", lines, (now() - start) * 1e3);
+  return 0;
+}
+
+/*........................ end of parse_script.c ............................*/
@@ -0,0 +1,197 @@
+#!/bin/sh
+#
+# Benchmark suite for ush, run by `make bench`
+#
+# Runs each workload under ush and under a baseline, /bin/sh or the
+# external programs ush has built in, and prints the time both took, as
+# a table or with -j as JSON.  A few checks run along, if one fails it is
+# reported on stderr and the script exits 1.  Sizes come from the
+# environment:
+#
+#   BENCH_N      launches and built in commands per run     (default 2000)
+#   BENCH_MB     megabytes pushed through the pipeline      (default 2048)
+#   BENCH_LINES  lines of the script that is only parsed    (default 1000000)
+#   BENCH_LONG   megabytes of the one line script parsed    (default 50)
+#   BENCH_RUNS   ush startups, with a .ushrc and with -c    (default 200)
+#
+# usage: bench/run.sh [-j] [ush binary]
+
+JSON=0
+if [ "$1" = "-j" ]; then
+  JSON=1
+  shift
+fi
+USH=$(cd "$(dirname "${1:-./ush}")" && pwd)/$(basename "${1:-./ush}")
+BENCH=$(cd "$(dirname "$0")" && pwd)
+N=${BENCH_N:-2000}
+MB=${BENCH_MB:-2048}
+LINES=${BENCH_LINES:-1000000}
+LONG=${BENCH_LONG:-50}
+RUNS=${BENCH_RUNS:-200}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/ush_bench.XXXXXX")
+
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+now() {
+  date +%s%N
+}
+
+# time_ms command...  runs the command and prints how long it took,
+# returns the command's status
+time_ms() {
+  start=$(now)
+  "$@" > /dev/null 2>&1
+  status=$?
+  end=$(now)
+  echo $(( (end - start) / 1000000 ))
+  return $status
+}
+
+STATUS=0
+# fail message  reports a check that did not pass
+fail() {
+  echo "bench: $*" >&2
+  STATUS=1
+}
+
+ROWS=0
+# report workload size ush_ms baseline_ms [baseline]
+report() {
+  if [ $JSON -eq 1 ]; then
+    [ $ROWS -eq 0 ] && printf '[\n' || printf ',\n'
+    printf '  {"workload": "%s", "size": "%s", "ush_ms": %d, "baseline": "%s", "baseline_ms": %d}' \
+      "$1" "$2" "$3" "${5:-sh}" "$4"
+  else
+    [ $ROWS -eq 0 ] && printf '%-12s %-16s %10s %-10s %12s %8s\n' \
+      workload size "ush ms" baseline "baseline ms" ratio
+    printf '%-12s %-16s %10d %-10s %12d %8s\n' "$1" "$2" "$3" "${5:-sh}" "$4" \
+      "$(awk "BEGIN { printf \"%.2f\", $3 / ($4 ? $4 : 1) }")"
+  fi
+  ROWS=$((ROWS + 1))
+}
+
+# Sequential launches of /bin/true
+i=0
+while [ $i -lt $N ]; do echo /bin/true; i=$((i + 1)); done > "$DIR/spawn.sh"
+report spawn "$N x /bin/true" \
+  "$(time_ms "$USH" "$DIR/spawn.sh")" "$(time_ms /bin/sh "$DIR/spawn.sh")"
+
+# Hundreds of exported variables, then launches that all pass them on
+i=0
+while [ $i -lt 500 ]; do echo "setenv BENCH_VAR_$i value_$i"; i=$((i + 1)); done > "$DIR/env.sh"
+sed -e 's/^setenv \([^ ]*\) /export \1=/' "$DIR/env.sh" > "$DIR/env_sh.sh"
+i=0
+while [ $i -lt $N ]; do echo /bin/true; i=$((i + 1)); done | tee -a "$DIR/env_sh.sh" >> "$DIR/env.sh"
+report env "$N x 500 vars" \
+  "$(time_ms "$USH" "$DIR/env.sh")" "$(time_ms /bin/sh "$DIR/env_sh.sh")"
+
+# Built in commands only, nothing is started
+i=0
+while [ $i -lt $N ]; do echo "cd /"; echo "echo $i"; i=$((i + 1)); done > "$DIR/builtin.sh"
+report builtin "$((N * 2)) builtins" \
+  "$(time_ms "$USH" "$DIR/builtin.sh")" "$(time_ms /bin/sh "$DIR/builtin.sh")"
+
+# The utilities ush has built in against the programs, both run by ush
+i=0
+while [ $i -lt $N ]; do
+  echo "test -f /etc/passwd"
+  echo "basename /usr/lib/file$i.so .so"
+  echo "dirname /usr/lib/file$i.so"
+  echo "printf %s-%d, file $i"
+  i=$((i + 1))
+done > "$DIR/utils.sh"
+sed -e 's,^test,/usr/bin/test,' -e 's,^basename,/usr/bin/basename,' \
+    -e 's,^dirname,/usr/bin/dirname,' -e 's,^printf,/usr/bin/printf,' "$DIR/utils.sh" > "$DIR/external.sh"
+report utils "$((N * 4)) commands" \
+  "$(time_ms "$USH" "$DIR/utils.sh")" "$(time_ms "$USH" "$DIR/external.sh")" external
+
+# The built in cat of a file appended to itself has to stop at once, in
+# the shell, instead of copying for ever
+echo data > "$DIR/self"
+if timeout 10 "$USH" -c "cat $DIR/self >> $DIR/self" 2> /dev/null ||
+   [ "$(wc -c < "$DIR/self")" -ne 5 ]; then
+  fail "cat of a file appended to itself did not stop"
+fi
+rm -f "$DIR/self"
+
+# A pipeline moving a lot of data, every stage has to run at once
+head -c $((MB * 1024 * 1024)) /dev/zero | tr '\0' 'a' > "$DIR/data"
+echo "cat $DIR/data | tr a-z A-Z | wc -c" > "$DIR/pipeline.sh"
+report pipeline "$MB MB" \
+  "$(time_ms "$USH" "$DIR/pipeline.sh")" "$(time_ms /bin/sh "$DIR/pipeline.sh")"
+rm -f "$DIR/data"
+
+# Parsing only, sh -n is the baseline
+awk -v n=$LINES 'BEGIN {
+  for(i = 0; i < n; i++)
+    printf "ls -l /usr/lib/file%d \"quoted arg\" | grep -v x%d | wc -l >> /tmp/out ; echo %d &\n", i, i, i
+}' > "$DIR/parse.sh"
+report parse "$LINES lines" \
+  "$(time_ms "$BENCH/parse_script" "$DIR/parse.sh")" "$(time_ms /bin/sh -n "$DIR/parse.sh")"
+
+# One line of many pipes and a long run of blanks, parsed with a 256 KB
+# stack; a tenth of it first.  Both have to parse and the time has to
+# grow about linearly, 10 times the input may not take over 20 times as
+# long (the small run counts as at least 10 ms, below that it is noise)
+long_line() {
+  awk -v mb=$1 'BEGIN {
+    s = "printf %s-%s argument_number_one argument_number_two argument_three > /dev/null ; "
+    n = int(mb * 1048576 / length(s))
+    for(i = 0; i < n; i++) {
+      printf "%s", s
+      if(i == int(n / 2))
+        for(j = 0; j < 100000; j++)
+          printf " "
+    }
+    printf "\n"
+  }' > "$DIR/long.sh"
+}
+small_ms=
+for mb in $((LONG / 10)) $LONG; do
+  long_line $mb
+  ms=$(ulimit -s 256; time_ms "$BENCH/parse_script" "$DIR/long.sh") ||
+    fail "parse_script failed on a $mb MB line"
+  report longline "$mb MB, 1 line" "$ms" "$(time_ms /bin/sh -n "$DIR/long.sh")"
+  [ -z "$small_ms" ] && small_ms=$ms
+done
+rm -f "$DIR/long.sh"
+[ $small_ms -lt 10 ] && small_ms=10
+[ $ms -gt $((small_ms * 20)) ] &&
+  fail "parsing a $LONG MB line took $ms ms, over 20 times the tenth of it"
+
+# A script run a second time, from the image compiled into
+# $HOME/.cache/ush the first time
+mkdir "$DIR/home"
+awk -v n=$((LINES / 10)) 'BEGIN {
+  for(i = 0; i < n; i++)
+    printf "true some args %d for the builtin > /dev/null ; pwd > /dev/null\n", i
+}' > "$DIR/script.sh"
+HOME=$DIR/home "$USH" "$DIR/script.sh"
+report script "$((LINES / 10)) lines" \
+  "$(HOME=$DIR/home time_ms "$USH" "$DIR/script.sh")" "$(time_ms /bin/sh "$DIR/script.sh")"
+rm -rf "$DIR/script.sh" "$DIR/home/.cache"
+
+# Interactive startup with a .ushrc, sh reads the same file through $ENV
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  echo "cd /"
+  echo "echo startup $i"
+done > "$DIR/home/.ushrc"
+startup() {
+  i=0
+  while [ $i -lt $RUNS ]; do
+    "$@" < /dev/null
+    i=$((i + 1))
+  done
+}
+report startup "$RUNS x .ushrc" \
+  "$(HOME=$DIR/home time_ms startup "$USH")" \
+  "$(ENV=$DIR/home/.ushrc time_ms startup /bin/sh -i)"
+
+# Non-interactive starts, like a probe running one command, which should
+# not look up anything a prompt or cd needs
+report probe "$RUNS x -c" \
+  "$(HOME=$DIR/home time_ms startup "$USH" -c true)" \
+  "$(time_ms startup /bin/sh -c true)"
+
+[ $JSON -eq 1 ] && printf '\n]\n'
+exit $STATUS
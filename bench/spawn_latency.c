@@ -0,0 +1,127 @@
+/******************************************************************************
+ *
+ *  File Name........: spawn_latency.c
+ *
+ *  Description......:
+ *	Spawn latency microbenchmark.  Starts a program (default /bin/true)
+ *  N times with the fork + execve the shell used to do and N times with
+ *  spawn_process() from launch.c, waiting for each child, and prints the
+ *  average time per launch.  With -m MB the process first allocates and
+ *  touches that much memory, like a shell with a big history would have,
+ *  which is where fork gets slow.  "spawn nice" asks for a nice value,
+ *  which makes spawn_process() fork.  With -z the zygote is started
+ *  before the memory is allocated and spawn_process() goes through it.
+ *
+ *  usage: spawn_latency [-z] [-n count] [-m MB] [program]
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../launch.h"
+
+extern char **environ;
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void launch_fork(char *path, char **argv) {
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    execve(path, argv, environ);
+    _exit(127);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+static void spawn(char *path, char **argv, int priority) {
+  struct spawn_attr attr;
+  pid_t pid;
+  int error;
+
+  spawn_attr_init(&attr);
+  attr.path = path;
+  attr.argv = argv;
+  attr.envp = environ;
+  attr.priority = priority;
+  pid = spawn_process(&attr, &error);
+  if(pid < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(error));
+    exit(1);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+static void launch_spawn(char *path, char **argv) {
+  spawn(path, argv, 0);
+}
+
+static void launch_nice(char *path, char **argv) {
+  spawn(path, argv, 1);
+}
+
+static void run(const char *name, void (*launch)(char *, char **), char *path, int count) {
+  char *argv[] = {path, NULL};
+  double start;
+  int i;
+
+  start = now();
+  for(i = 0; i < count; i++)
+    launch(path, argv);
+  printf("%-12s %8d launches %10.1f us/launch\n", name, count,
+         (now() - start) * 1e6 / count);
+}
+
+int main(int argc, char *argv[]) {
+  int count = 2000;
+  long ballast_mb = 0;
+  char *path = "/bin/true";
+  char *ballast;
+  int opt, zygote = 0;
+
+  while((opt = getopt(argc, argv, "zn:m:")) != -1) {
+    switch(opt) {
+    case 'z':
+      zygote = 1;
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'm':
+      ballast_mb = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-z] [-n count] [-m MB] [program]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(optind < argc)
+    path = argv[optind];
+
+  if(zygote && zygote_start() < 0) {
+    perror("zygote");
+    return 1;
+  }
+  if(ballast_mb > 0) {
+    ballast = malloc(ballast_mb << 20);
+    memset(ballast, 1, ballast_mb << 20);
+    printf("holding %ld MB\n", ballast_mb);
+  }
+
+  run("fork+execve", launch_fork, path, count);
+  run(zygote ? "zygote" : "spawn", launch_spawn, path, count);
+  run(zygote ? "zygote nice" : "spawn nice", launch_nice, path, count);
+  return 0;
+}
+
+/*........................ end of spawn_latency.c ...........................*/
@@ -0,0 +1,137 @@
+/******************************************************************************
+ *
+ *  File Name........: copy.c
+ *
+ *  Description......:
+ *	Copies everything from one descriptor to another for the cat
+ *  builtin, letting the kernel move the data where it can:
+ *
+ *	file to file	copy_file_range, which may not copy at all on file
+ *			systems that share extents
+ *	to or from a pipe  splice, the pages are moved into the pipe
+ *	file to anything   sendfile
+ *
+ *  When the kernel refuses (different file systems, O_APPEND output, a
+ *  terminal, an old kernel) before anything was copied the next method
+ *  is tried, and the last one is a plain read/write loop with a large
+ *  buffer.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "copy.h"
+
+#define COPY_CHUNK	(1 << 20)	// bytes asked for per system call
+#define COPY_BUFFER	(128 << 10)	// buffer of the read/write loop
+
+// the ways the kernel can copy
+enum copy_method {Mrange, Msplice, Msendfile};
+
+// The kernel cannot do this copy, another method may
+static int unsupported(int error) {
+  return error == EINVAL || error == ENOSYS || error == EXDEV ||
+         error == EOPNOTSUPP || error == EBADF;
+}
+
+/*
+ * Copies with one of the kernel methods
+ * Returns 1 when everything was copied, 0 if the method cannot be used
+ * for these descriptors (nothing was copied then) and -1 on an error.
+ */
+static int copy_kernel(int in, int out, enum copy_method method) {
+  ssize_t n;
+  int copied = 0;
+
+  while(1) {
+    switch(method) {
+    case Mrange:
+      n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+      break;
+    case Msplice:
+      n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+      break;
+    case Msendfile:
+      n = sendfile(out, in, NULL, COPY_CHUNK);
+      break;
+    }
+    if(n == 0)
+      return 1;
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      if(!copied && unsupported(errno))
+        return 0;
+      return -1;
+    }
+    copied = 1;
+  }
+}
+
+static int copy_read_write(int in, int out) {
+  static char *buffer = NULL;
+  ssize_t n, w, done;
+
+  if(buffer == NULL) {
+    buffer = malloc(COPY_BUFFER);
+    if(buffer == NULL)
+      return -1;
+  }
+
+  while(1) {
+    n = read(in, buffer, COPY_BUFFER);
+    if(n == 0)
+      return 0;
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    for(done = 0; done < n; done += w) {
+      w = write(out, buffer + done, n - done);
+      if(w < 0) {
+        if(errno == EINTR) {
+          w = 0;
+          continue;
+        }
+        return -1;
+      }
+    }
+  }
+}
+
+/*
+ * Copies everything that can be read from in to out
+ * Returns 0, or -1 with errno set
+ */
+int copy_fd(int in, int out) {
+  struct stat in_stat, out_stat;
+  int rc;
+
+  if(fstat(in, &in_stat) < 0 || fstat(out, &out_stat) < 0)
+    return -1;
+
+  if(S_ISREG(in_stat.st_mode) && S_ISREG(out_stat.st_mode)) {
+    rc = copy_kernel(in, out, Mrange);
+    if(rc != 0)
+      return rc > 0 ? 0 : -1;
+  }
+  if(S_ISFIFO(in_stat.st_mode) || S_ISFIFO(out_stat.st_mode)) {
+    rc = copy_kernel(in, out, Msplice);
+    if(rc != 0)
+      return rc > 0 ? 0 : -1;
+  }
+  if(S_ISREG(in_stat.st_mode)) {
+    rc = copy_kernel(in, out, Msendfile);
+    if(rc != 0)
+      return rc > 0 ? 0 : -1;
+  }
+  return copy_read_write(in, out);
+}
+
+/*........................ end of copy.c ....................................*/
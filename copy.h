@@ -0,0 +1,15 @@
+/******************************************************************************
+ *
+ *  File Name........: copy.h
+ *
+ *  Description......: header file for the data copy of the cat builtin.
+ *
+ *****************************************************************************/
+
+#ifndef COPY_H
+#define COPY_H
+
+int copy_fd(int in, int out);
+
+#endif /* COPY_H */
+/*........................ end of copy.h ....................................*/
@@ -0,0 +1,236 @@
+/******************************************************************************
+ *
+ *  File Name........: env.c
+ *
+ *  Description......:
+ *	The environment of ush.  It is kept in a hash table, so looking a
+ *  variable up or changing it does not walk a list of all of them like
+ *  the C library's getenv() and setenv() do.
+ *
+ *  Programs get the environment as an envp array that is built from the
+ *  table when it is first needed after a change and then handed to every
+ *  program started until the next change.  environ is pointed at it as
+ *  well, for the few places that still go through the C library.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "env.h"
+
+extern char **environ;
+
+// A variable, text is "name=value", value points into it.  Unset
+// variables keep their slot (text is NULL) so lookups can probe past it.
+struct var {
+  char *name;
+  char *text;
+  char *value;
+  unsigned int serial;		// when it was first set, for listing order
+};
+
+struct var_table {
+  struct var *vars;
+  int size;			// slots, a power of two
+  int used;			// slots with a name
+  int count;			// variables that are set
+  unsigned int serial;
+};
+
+static struct var_table env_table;
+
+// The cached envp, NULL after the environment changed
+static char **envp = NULL;
+
+// Texts replaced since envp was built, environ points to them until the
+// next one is
+static char **retired = NULL;
+static int num_retired = 0, max_retired = 0;
+
+// Old texts may still be in environ, they are freed once it is rebuilt
+static void free_text(char *text) {
+  if(text == NULL)
+    return;
+  if(num_retired == max_retired) {
+    max_retired = max_retired ? max_retired * 2 : 16;
+    retired = realloc(retired, max_retired * sizeof(char *));
+  }
+  retired[num_retired++] = text;
+}
+
+static unsigned int hash_name(const char *s) {
+  unsigned int h = 2166136261u;
+
+  while(*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static struct var *find_slot(struct var *vars, int size, const char *name) {
+  unsigned int i = hash_name(name) & (size - 1);
+
+  while(vars[i].name != NULL && strcmp(vars[i].name, name))
+    i = (i + 1) & (size - 1);
+  return &vars[i];
+}
+
+// Rehashes into a table twice as big, dropping the unset variables
+static void grow_table(struct var_table *t) {
+  struct var *old = t -> vars;
+  int old_size = t -> size;
+  int i;
+
+  t -> size = old_size ? old_size * 2 : 128;
+  t -> vars = calloc(t -> size, sizeof(struct var));
+  t -> used = 0;
+  for(i = 0; i < old_size; i++) {
+    if(old[i].text != NULL) {
+      *find_slot(t -> vars, t -> size, old[i].name) = old[i];
+      t -> used++;
+    } else {
+      free(old[i].name);
+    }
+  }
+  free(old);
+}
+
+static struct var *lookup(struct var_table *t, const char *name) {
+  struct var *v;
+
+  if(t -> size == 0)
+    return NULL;
+  v = find_slot(t -> vars, t -> size, name);
+  return v -> text != NULL ? v : NULL;
+}
+
+static void set_var(struct var_table *t, const char *name, const char *value) {
+  struct var *v;
+  int name_len = strlen(name);
+  int value_len = strlen(value);
+
+  if((t -> used + 1) * 4 > t -> size * 3)
+    grow_table(t);
+  v = find_slot(t -> vars, t -> size, name);
+  if(v -> name == NULL) {
+    v -> name = strdup(name);
+    t -> used++;
+  }
+  if(v -> text == NULL) {
+    v -> serial = t -> serial++;
+    t -> count++;
+  }
+  free_text(v -> text);
+  v -> text = malloc(name_len + value_len + 2);
+  memcpy(v -> text, name, name_len);
+  v -> text[name_len] = '=';
+  memcpy(v -> text + name_len + 1, value, value_len + 1);
+  v -> value = v -> text + name_len + 1;
+}
+
+// Returns 1 if there was such a variable
+static int unset_var(struct var_table *t, const char *name) {
+  struct var *v = lookup(t, name);
+
+  if(v == NULL)
+    return 0;
+  free_text(v -> text);
+  v -> text = v -> value = NULL;
+  t -> count--;
+  return 1;
+}
+
+static int by_serial(const void *a, const void *b) {
+  const struct var *x = *(const struct var **)a;
+  const struct var *y = *(const struct var **)b;
+
+  return x -> serial < y -> serial ? -1 : x -> serial > y -> serial;
+}
+
+// Returns the set variables of a table in the order they were first set,
+// a malloc'd array of count pointers
+static struct var **sorted_vars(struct var_table *t) {
+  struct var **list = malloc((t -> count + 1) * sizeof(struct var *));
+  int i, n = 0;
+
+  for(i = 0; i < t -> size; i++)
+    if(t -> vars[i].text != NULL)
+      list[n++] = &t -> vars[i];
+  qsort(list, n, sizeof(struct var *), by_serial);
+  return list;
+}
+
+static void print_vars(struct var_table *t) {
+  struct var **list = sorted_vars(t);
+  int i;
+
+  for(i = 0; i < t -> count; i++)
+    printf("%s=%s\n", list[i] -> name, list[i] -> value);
+  free(list);
+}
+
+// Loads the environment the shell was started with
+void env_init() {
+  char **e, *eq, *name;
+
+  for(e = environ; *e != NULL; e++) {
+    eq = strchr(*e, '=');
+    if(eq == NULL)
+      continue;
+    name = strndup(*e, eq - *e);
+    set_var(&env_table, name, eq + 1);
+    free(name);
+  }
+}
+
+const char *env_get(const char *name) {
+  struct var *v = lookup(&env_table, name);
+
+  return v != NULL ? v -> value : NULL;
+}
+
+void env_set(const char *name, const char *value) {
+  set_var(&env_table, name, value);
+  envp = NULL;
+}
+
+void env_unset(const char *name) {
+  if(unset_var(&env_table, name))
+    envp = NULL;
+}
+
+/*
+ * Returns the environment for execve and posix_spawn
+ * The array is built once per change of the environment and stays valid
+ * until the next change.
+ */
+char **env_envp() {
+  static char **block = NULL;
+  struct var **list;
+  int i;
+
+  if(envp != NULL)
+    return envp;
+
+  list = sorted_vars(&env_table);
+  block = realloc(block, (env_table.count + 1) * sizeof(char *));
+  for(i = 0; i < env_table.count; i++)
+    block[i] = list[i] -> text;
+  block[i] = NULL;
+  free(list);
+  for(i = 0; i < num_retired; i++)
+    free(retired[i]);
+  num_retired = 0;
+
+  envp = environ = block;
+  return envp;
+}
+
+void env_print() {
+  print_vars(&env_table);
+}
+
+/*........................ end of env.c .....................................*/
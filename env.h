@@ -0,0 +1,25 @@
+/******************************************************************************
+ *
+ *  File Name........: env.h
+ *
+ *  Description......: header file for the environment of ush.
+ *
+ *****************************************************************************/
+
+#ifndef ENV_H
+#define ENV_H
+
+// Loads environ into the table, called once at startup
+void env_init(void);
+
+// The environment passed to programs (setenv, unsetenv)
+const char *env_get(const char *name);
+void env_set(const char *name, const char *value);
+void env_unset(const char *name);
+void env_print(void);
+
+// The envp for starting a program, rebuilt only after a change
+char **env_envp(void);
+
+#endif /* ENV_H */
+/*........................ end of env.h .....................................*/
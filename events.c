@@ -0,0 +1,325 @@
+/******************************************************************************
+ *
+ *  File Name........: events.c
+ *
+ *  Description......:
+ *	The event loop of ush.  Everything the shell waits for is watched
+ *  through one epoll descriptor: every child it started (a pidfd each),
+ *  timers (a timerfd each), SIGCHLD (a signalfd) and any descriptor a
+ *  caller wants to read from.  events_run() sleeps until one of them is
+ *  ready and calls the handler that was registered for it.
+ *
+ *  The loop owns the children.  A child is reaped only through its
+ *  pidfd, with waitid(P_PIDFD), which also gives what it used, so no
+ *  wait for one job or builtin can take the status of a child another
+ *  one is waiting for.  A pidfd only becomes readable when its process
+ *  ends.  A child that stops or continues is found when SIGCHLD arrives,
+ *  by asking each child for such a change without reaping it.
+ *
+ *  Waiting for all of a pipeline or for any of N children is a loop
+ *  around events_run() until the handlers have seen enough.
+ *
+ *  A forked child of the shell that runs a built in command starts with
+ *  a loop of its own the first time it uses one, the watches of the
+ *  shell are not its to use.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include "events.h"
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+#define MAX_EVENTS 32
+
+enum {Echild, Etimer, Efd, Esignal};
+
+struct event_t {
+  int kind;
+  int fd;			// pidfd, timerfd or the caller's, -1 if none
+  pid_t pid;			// a child's
+  ChildHandler child;
+  EventHandler ready;		// a timer's or descriptor's
+  void *data;
+  int removed;			// freed once the events at hand are handled
+  struct event_t *next;		// list of children or of removed events
+};
+
+static pid_t owner = 0;		// the process the loop was set up in
+static int epfd = -1;
+static struct event_t sigchld_event = {.kind = Esignal, .fd = -1};
+static Event children = NULL;
+static Event removed = NULL;
+static int dispatching = 0;	// events_run() is calling handlers
+
+// Sets up the loop, once in every process that uses it
+static void setup() {
+  struct epoll_event event;
+  sigset_t set;
+
+  if(owner == getpid())
+    return;
+  owner = getpid();
+  children = removed = NULL;
+  dispatching = 0;
+
+  // SIGCHLD is blocked for good and read from the signalfd
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  sigchld_event.fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  event.events = EPOLLIN;
+  event.data.ptr = &sigchld_event;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, sigchld_event.fd, &event);
+}
+
+// Makes the loop ready, before the first child is started
+void events_init() {
+  setup();
+}
+
+static Event watch(int kind, int fd, void *data) {
+  struct epoll_event event;
+  Event e = calloc(1, sizeof(*e));
+
+  e -> kind = kind;
+  e -> fd = fd;
+  e -> data = data;
+  if(fd >= 0) {
+    event.events = EPOLLIN;
+    event.data.ptr = e;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+  }
+  return e;
+}
+
+// Frees the removed events, when no handler can still see them
+static void purge() {
+  Event *p, e;
+
+  for(p = &children; *p != NULL; ) {
+    e = *p;
+    if(e -> removed) {
+      *p = e -> next;
+      free(e);
+    } else {
+      p = &e -> next;
+    }
+  }
+  while(removed != NULL) {
+    e = removed;
+    removed = e -> next;
+    free(e);
+  }
+}
+
+/*
+ * Watches a child of the shell until it ends
+ * handler is called for every stop, continue and for the end, after
+ * which the watch is gone by itself.  Without a pidfd (an old kernel, no
+ * descriptors left) the child is looked at whenever SIGCHLD comes.
+ */
+Event event_child(pid_t pid, ChildHandler handler, void *data) {
+  Event e;
+
+  setup();
+  e = watch(Echild, pidfd_open(pid, 0), data);
+  e -> pid = pid;
+  e -> child = handler;
+  e -> next = children;
+  children = e;
+  return e;
+}
+
+/*
+ * Calls handler once, seconds from now
+ * The timer is kept until event_remove(), which also stops it if it has
+ * not gone off yet.  Returns NULL if there was no timer to be had.
+ */
+Event event_timer(double seconds, EventHandler handler, void *data) {
+  struct itimerspec when;
+  Event e;
+  int fd;
+
+  setup();
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(fd < 0)
+    return NULL;
+  memset(&when, 0, sizeof(when));
+  if(seconds > 0) {
+    when.it_value.tv_sec = (time_t)seconds;
+    when.it_value.tv_nsec = (seconds - when.it_value.tv_sec) * 1e9;
+  }
+  // A time of zero would disarm it
+  if(when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+    when.it_value.tv_nsec = 1;
+  timerfd_settime(fd, 0, &when, NULL);
+
+  e = watch(Etimer, fd, data);
+  e -> ready = handler;
+  return e;
+}
+
+// Calls handler whenever fd can be read, until event_remove()
+// The descriptor stays the caller's, it is not closed.  Returns NULL if
+// it cannot be watched, a regular file for one.
+Event event_fd(int fd, EventHandler handler, void *data) {
+  struct epoll_event event;
+  Event e;
+
+  setup();
+  e = watch(Efd, -1, data);
+  e -> fd = fd;
+  e -> ready = handler;
+  event.events = EPOLLIN;
+  event.data.ptr = e;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    free(e);
+    return NULL;
+  }
+  return e;
+}
+
+// Stops watching, a child then is never reaped by the loop
+void event_remove(Event e) {
+  if(e == NULL || e -> removed || owner != getpid())
+    return;
+  e -> removed = 1;
+  if(e -> fd >= 0) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, e -> fd, NULL);
+    if(e -> kind != Efd)
+      close(e -> fd);
+    e -> fd = -1;
+  }
+  // Children stay in their list until it is purged
+  if(e -> kind != Echild) {
+    e -> next = removed;
+    removed = e;
+  }
+  if(!dispatching)
+    purge();
+}
+
+// The wait status of what waitid reported
+static int wait_status(const siginfo_t *info) {
+  switch(info -> si_code) {
+  case CLD_EXITED:
+    return (info -> si_status & 0xff) << 8;
+  case CLD_KILLED:
+    return info -> si_status;
+  case CLD_DUMPED:
+    return info -> si_status | 0x80;
+  case CLD_STOPPED:
+  case CLD_TRAPPED:
+    return (info -> si_status << 8) | 0x7f;
+  default:
+    return 0xffff;		// continued
+  }
+}
+
+/*
+ * Hands a state change of a child to its handler, options tell which
+ * kinds are looked for.  Returns 1 if there was one.
+ * The waitid system call is used, the C library's has no rusage.
+ */
+static int collect(Event e, int options) {
+  struct rusage usage;
+  siginfo_t info;
+  long rc;
+
+  memset(&info, 0, sizeof(info));
+  memset(&usage, 0, sizeof(usage));
+  if(e -> fd >= 0)
+    rc = syscall(SYS_waitid, P_PIDFD, e -> fd, &info, options | WNOHANG, &usage);
+  else
+    rc = syscall(SYS_waitid, P_PID, e -> pid, &info, options | WNOHANG, &usage);
+
+  // Without WEXITED a child that already ended is no child to wait for
+  if(rc < 0 && errno == ECHILD && (options & WEXITED)) {
+    // Reaped behind our back (SIGCHLD ignored), its status is lost
+    event_remove(e);
+    e -> child(e -> pid, W_EXITCODE(127, 0), &usage, e -> data);
+    return 1;
+  }
+  if(rc < 0 || info.si_pid == 0)
+    return 0;
+
+  if(info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED) {
+    event_remove(e);
+    e -> child(e -> pid, wait_status(&info), &usage, e -> data);
+  } else {
+    e -> child(e -> pid, wait_status(&info), NULL, e -> data);
+  }
+  return 1;
+}
+
+// SIGCHLD came: looks for children that stopped or continued, and for
+// the end of those without a pidfd
+static void child_signal() {
+  struct signalfd_siginfo info;
+  Event e, next;
+
+  while(read(sigchld_event.fd, &info, sizeof(info)) == sizeof(info))
+    ;
+  for(e = children; e != NULL; e = next) {
+    next = e -> next;
+    while(!e -> removed &&
+          collect(e, WSTOPPED | WCONTINUED | (e -> fd < 0 ? WEXITED : 0)))
+      ;
+  }
+}
+
+/*
+ * Waits up to timeout_ms (-1 for as long as it takes, 0 not at all) for
+ * something to happen and calls the handlers of all that did
+ */
+void events_run(int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t expirations;
+  Event e;
+  int i, n;
+
+  setup();
+  n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+  dispatching++;
+  for(i = 0; i < n; i++) {
+    e = events[i].data.ptr;
+    if(e -> removed)
+      continue;
+    switch(e -> kind) {
+    case Echild:
+      collect(e, WEXITED);
+      break;
+    case Etimer:
+      if(read(e -> fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        e -> ready(e -> data);
+      break;
+    case Efd:
+      e -> ready(e -> data);
+      break;
+    case Esignal:
+      child_signal();
+      break;
+    }
+  }
+  if(--dispatching == 0)
+    purge();
+}
+
+/*........................ end of events.c ..................................*/
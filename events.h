@@ -0,0 +1,37 @@
+/******************************************************************************
+ *
+ *  File Name........: events.h
+ *
+ *  Description......: header file for the event loop of ush.
+ *
+ *****************************************************************************/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* something the loop watches: a child, a timer or a descriptor */
+typedef struct event_t *Event;
+
+/* called when a child stopped, continued or ended, status is a wait
+ * status (WIFEXITED() and friends work on it) and usage is set only when
+ * the child ended
+ */
+typedef void (*ChildHandler)(pid_t pid, int status, const struct rusage *usage, void *data);
+
+/* called when a timer expired or a descriptor can be read */
+typedef void (*EventHandler)(void *data);
+
+void events_init(void);
+
+Event event_child(pid_t pid, ChildHandler handler, void *data);
+Event event_timer(double seconds, EventHandler handler, void *data);
+Event event_fd(int fd, EventHandler handler, void *data);
+void event_remove(Event);
+
+void events_run(int timeout_ms);
+
+#endif /* EVENTS_H */
+/*........................ end of events.h ..................................*/
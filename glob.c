@@ -0,0 +1,470 @@
+/******************************************************************************
+ *
+ *  File Name........: glob.c
+ *
+ *  Description......:
+ *	Glob expansion for ush: *, ?, [...] and ** for any number of
+ *  directories.  A pattern is split at its slashes and the directories
+ *  are walked one component at a time.  They are read with getdents64,
+ *  so a directory of any size takes a few system calls, and the type in
+ *  each entry tells what is a directory without a stat per file.
+ *
+ *  Every directory still to be read is a task on a stack.  A pattern
+ *  with ** can reach a whole tree, so a pool of threads takes tasks from
+ *  the stack; otherwise the calling thread does all of it.  Each thread
+ *  keeps and sorts its own matches, which are merged at the end.
+ *
+ *  Like sh, ** does not follow symbolic links and neither * nor ** match
+ *  names starting with a dot unless the pattern does.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "glob.h"
+
+#define MAX_THREADS	8
+#define DENTS_SIZE	(256 * 1024)	// getdents64 buffer of each thread
+#define BLOCK_SIZE	(64 * 1024)	// matches are kept in blocks this big
+
+// the entries getdents64 returns
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// a directory to read for component comp of the pattern
+struct task {
+  struct task *next;
+  int comp;
+  char dir[];			// as it appears in the matches, "" or ending in /
+};
+
+// storage for the matches of a thread
+struct block {
+  struct block *next;
+  size_t used;
+  char data[BLOCK_SIZE];
+};
+
+struct walk;
+
+struct worker {
+  struct walk *walk;
+  pthread_t thread;
+  char *dents;
+  char **paths;
+  int count, max;
+  struct block *blocks;
+};
+
+struct walk {
+  char **comps;			// the components, as in the pattern
+  char **literal;		// a component without wild cards, unescaped
+  int ncomps;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct task *tasks;
+  int busy;			// threads working on a task
+};
+
+/*
+ * Tells if a pattern has wild cards
+ * A [ without a closing ] is just a [, test's [ is not expanded.
+ */
+int glob_has_magic(const char *pattern) {
+  const char *p, *q;
+
+  for(p = pattern; *p != '\0'; p++) {
+    switch(*p) {
+    case '\\':
+      if(p[1] != '\0')
+        p++;
+      break;
+    case '*':
+    case '?':
+      return 1;
+    case '[':
+      q = p + 1;
+      if(*q == '!' || *q == '^')
+        q++;
+      if(*q == ']')
+        q++;
+      if(strchr(q, ']') != NULL)
+        return 1;
+      break;
+    }
+  }
+  return 0;
+}
+
+// Removes the backslashes from a pattern without wild cards
+static char *unescape(const char *pattern) {
+  char *result = malloc(strlen(pattern) + 1), *r = result;
+
+  for(; *pattern != '\0'; pattern++) {
+    if(*pattern == '\\' && pattern[1] != '\0')
+      pattern++;
+    *r++ = *pattern;
+  }
+  *r = '\0';
+  return result;
+}
+
+static char *save_path(struct worker *w, const char *dir, const char *name) {
+  size_t dir_len = strlen(dir), len = dir_len + strlen(name) + 1;
+  struct block *b = w -> blocks;
+  char *path;
+
+  if(b == NULL || b -> used + len > BLOCK_SIZE) {
+    b = malloc(sizeof(struct block) + (len > BLOCK_SIZE ? len : 0));
+    b -> used = 0;
+    b -> next = w -> blocks;
+    w -> blocks = b;
+  }
+  path = b -> data + b -> used;
+  b -> used += len;
+  memcpy(path, dir, dir_len);
+  strcpy(path + dir_len, name);
+
+  if(w -> count == w -> max) {
+    w -> max = w -> max ? w -> max * 2 : 256;
+    w -> paths = realloc(w -> paths, w -> max * sizeof(char *));
+  }
+  w -> paths[w -> count++] = path;
+  return path;
+}
+
+// Puts dir + name + / on the stack, to be read for component comp
+static void push_task(struct walk *walk, const char *dir, const char *name, int comp) {
+  size_t dir_len = strlen(dir), name_len = strlen(name);
+  struct task *t = malloc(sizeof(struct task) + dir_len + name_len + 2);
+
+  memcpy(t -> dir, dir, dir_len);
+  memcpy(t -> dir + dir_len, name, name_len);
+  t -> dir[dir_len + name_len] = '/';
+  t -> dir[dir_len + name_len + 1] = '\0';
+  t -> comp = comp;
+
+  pthread_mutex_lock(&walk -> lock);
+  t -> next = walk -> tasks;
+  walk -> tasks = t;
+  pthread_cond_signal(&walk -> changed);
+  pthread_mutex_unlock(&walk -> lock);
+}
+
+static int is_globstar(struct walk *walk, int comp) {
+  return comp < walk -> ncomps && !strcmp(walk -> comps[comp], "**");
+}
+
+// Tells if an entry is a directory, following symbolic links
+static int is_dir(int fd, const char *name, unsigned char type) {
+  struct stat sb;
+
+  if(type == DT_DIR)
+    return 1;
+  if(type != DT_LNK && type != DT_UNKNOWN)
+    return 0;
+  return fstatat(fd, name, &sb, 0) == 0 && S_ISDIR(sb.st_mode);
+}
+
+// Tells if an entry is a directory ** goes into, not a symbolic link
+static int is_real_dir(int fd, const char *name, unsigned char type) {
+  struct stat sb;
+
+  if(type != DT_UNKNOWN)
+    return type == DT_DIR;
+  return fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode);
+}
+
+// A name in dir matched component comp: it is a match if that was the
+// last one, otherwise a directory to read for the next
+static void matched(struct worker *w, int fd, const char *dir, const char *name,
+                    unsigned char type, int comp) {
+  if(comp == w -> walk -> ncomps - 1)
+    save_path(w, dir, name);
+  else if(is_dir(fd, name, type))
+    push_task(w -> walk, dir, name, comp + 1);
+}
+
+/*
+ * Reads a directory for component comp of the pattern
+ * A ** component also looks for the next component in the directory,
+ * it matches no directory at all too.
+ */
+static void read_dir(struct worker *w, const char *dir, int comp) {
+  struct walk *walk = w -> walk;
+  struct linux_dirent64 *d;
+  struct stat sb;
+  char *path, *name;
+  int fd, globstar, next, last;
+  long n, pos;
+
+  // Components without wild cards need no reading
+  if(walk -> literal[comp] != NULL) {
+    if(comp < walk -> ncomps - 1) {
+      push_task(walk, dir, walk -> literal[comp], comp + 1);
+      return;
+    }
+    path = malloc(strlen(dir) + strlen(walk -> literal[comp]) + 1);
+    strcpy(path, dir);
+    strcat(path, walk -> literal[comp]);
+    if(*path != '\0' && fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+      save_path(w, dir, walk -> literal[comp]);
+    free(path);
+    return;
+  }
+
+  fd = openat(AT_FDCWD, *dir != '\0' ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0)
+    return;
+
+  globstar = is_globstar(walk, comp);
+  next = globstar ? comp + 1 : comp;
+  last = walk -> ncomps - 1;
+  // **/name looks for name in this directory without reading it twice
+  if(globstar && next <= last && walk -> literal[next] != NULL)
+    read_dir(w, dir, next);
+
+  while((n = syscall(SYS_getdents64, fd, w -> dents, DENTS_SIZE)) > 0) {
+    for(pos = 0; pos < n; pos += d -> d_reclen) {
+      d = (struct linux_dirent64 *)(w -> dents + pos);
+      name = d -> d_name;
+      if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      if(globstar) {
+        if(name[0] == '.')
+          continue;
+        if(next > last)
+          save_path(w, dir, name);	// a trailing ** matches everything
+        else if(walk -> literal[next] == NULL &&
+                fnmatch(walk -> comps[next], name, FNM_PERIOD) == 0)
+          matched(w, fd, dir, name, d -> d_type, next);
+        if(is_real_dir(fd, name, d -> d_type))
+          push_task(walk, dir, name, comp);
+      } else if(fnmatch(walk -> comps[comp], name, FNM_PERIOD) == 0) {
+        matched(w, fd, dir, name, d -> d_type, comp);
+      }
+    }
+  }
+  close(fd);
+}
+
+static void swap_paths(char **paths, int i, int j) {
+  char *t = paths[i];
+
+  paths[i] = paths[j];
+  paths[j] = t;
+}
+
+/*
+ * Sorts paths that are equal up to depth, by their bytes from there
+ * Multikey quicksort: the paths are split by the byte at depth into
+ * less, equal and greater, and only the equal ones move on to the next
+ * byte.  A long directory all of them share costs a pass per byte, not
+ * a strcmp of it per comparison like qsort.
+ */
+static void sort_paths(char **paths, int n, int depth) {
+  unsigned char pivot, c;
+  int less, greater, i, j;
+
+  while(n > 1) {
+    if(n < 16) {
+      for(i = 1; i < n; i++)
+        for(j = i; j > 0 && strcmp(paths[j - 1] + depth, paths[j] + depth) > 0; j--)
+          swap_paths(paths, j, j - 1);
+      return;
+    }
+
+    swap_paths(paths, 0, n / 2);
+    pivot = paths[0][depth];
+    less = 0;
+    greater = n - 1;
+    for(i = 1; i <= greater; ) {
+      c = paths[i][depth];
+      if(c < pivot)
+        swap_paths(paths, less++, i++);
+      else if(c > pivot)
+        swap_paths(paths, i, greater--);
+      else
+        i++;
+    }
+    sort_paths(paths, less, depth);
+    sort_paths(paths + greater + 1, n - greater - 1, depth);
+    if(pivot == '\0')
+      return;			// the equal ones are the same path
+    paths += less;
+    n = greater - less + 1;
+    depth++;
+  }
+}
+
+// Runs tasks until there are none left and no thread can make more
+static void *work(void *arg) {
+  struct worker *w = arg;
+  struct walk *walk = w -> walk;
+  struct task *t;
+
+  w -> dents = malloc(DENTS_SIZE);
+  pthread_mutex_lock(&walk -> lock);
+  while(1) {
+    while(walk -> tasks == NULL && walk -> busy > 0)
+      pthread_cond_wait(&walk -> changed, &walk -> lock);
+    if(walk -> tasks == NULL)
+      break;
+    t = walk -> tasks;
+    walk -> tasks = t -> next;
+    walk -> busy++;
+    pthread_mutex_unlock(&walk -> lock);
+
+    read_dir(w, t -> dir, t -> comp);
+    free(t);
+
+    pthread_mutex_lock(&walk -> lock);
+    if(--walk -> busy == 0 && walk -> tasks == NULL)
+      pthread_cond_broadcast(&walk -> changed);
+  }
+  pthread_mutex_unlock(&walk -> lock);
+  free(w -> dents);
+
+  // The sorting is done by every thread for its own matches
+  sort_paths(w -> paths, w -> count, 0);
+  return NULL;
+}
+
+// Merges the sorted matches of the threads into one sorted list
+static void merge(struct worker *workers, int nworkers, struct glob_list *list) {
+  int *next = calloc(nworkers, sizeof(int));
+  int i, best, total = 0;
+
+  for(i = 0; i < nworkers; i++)
+    total += workers[i].count;
+  list -> paths = malloc((total + 1) * sizeof(char *));
+  list -> count = 0;
+  while(list -> count < total) {
+    best = -1;
+    for(i = 0; i < nworkers; i++)
+      if(next[i] < workers[i].count &&
+         (best < 0 || strcmp(workers[i].paths[next[i]], workers[best].paths[next[best]]) < 0))
+        best = i;
+    list -> paths[list -> count++] = workers[best].paths[next[best]++];
+  }
+  list -> paths[total] = NULL;
+  free(next);
+}
+
+/*
+ * Expands a pattern into the sorted list of paths it matches
+ * Returns the number of matches, 0 if there are none.  The list has to
+ * be freed with glob_free().
+ */
+int glob_expand(const char *pattern, struct glob_list *list) {
+  struct walk walk;
+  struct worker *workers;
+  struct block *b;
+  char *copy, *comp, *save;
+  const char *start = "";
+  int i, nworkers = 1, max = 2;
+
+  memset(list, 0, sizeof(*list));
+  memset(&walk, 0, sizeof(walk));
+  if(*pattern == '/') {
+    start = "/";
+    while(*pattern == '/')
+      pattern++;
+  }
+
+  // Split it up, a ** next to another is the same as one
+  for(i = 0; pattern[i] != '\0'; i++)
+    max += pattern[i] == '/';
+  copy = strdup(pattern);
+  walk.comps = malloc(max * sizeof(char *));
+  walk.literal = malloc(max * sizeof(char *));
+  for(comp = strtok_r(copy, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+    if(!strcmp(comp, "**") && walk.ncomps > 0 && is_globstar(&walk, walk.ncomps - 1))
+      continue;
+    walk.comps[walk.ncomps] = comp;
+    walk.literal[walk.ncomps] = glob_has_magic(comp) ? NULL : unescape(comp);
+    if(!strcmp(comp, "**"))
+      nworkers = MAX_THREADS;
+    walk.ncomps++;
+  }
+  // a/*/ matches only directories, they end in a /
+  if(pattern[0] != '\0' && pattern[strlen(pattern) - 1] == '/') {
+    walk.comps[walk.ncomps] = "";
+    walk.literal[walk.ncomps++] = strdup("");
+  }
+
+  if(walk.ncomps > 0) {
+    if(nworkers > 1) {
+      i = sysconf(_SC_NPROCESSORS_ONLN);
+      if(i < nworkers)
+        nworkers = i > 0 ? i : 1;
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.changed, NULL);
+    walk.tasks = malloc(sizeof(struct task) + strlen(start) + 1);
+    walk.tasks -> next = NULL;
+    walk.tasks -> comp = 0;
+    strcpy(walk.tasks -> dir, start);
+
+    workers = calloc(nworkers, sizeof(struct worker));
+    for(i = 0; i < nworkers; i++)
+      workers[i].walk = &walk;
+    for(i = 1; i < nworkers; i++)
+      if(pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+        break;
+    nworkers = i < nworkers ? i : nworkers;
+    work(&workers[0]);
+    for(i = 1; i < nworkers; i++)
+      pthread_join(workers[i].thread, NULL);
+
+    merge(workers, nworkers, list);
+    // The blocks go with the list
+    for(i = 0; i < nworkers; i++) {
+      while((b = workers[i].blocks) != NULL) {
+        workers[i].blocks = b -> next;
+        b -> next = list -> blocks;
+        list -> blocks = b;
+      }
+      free(workers[i].paths);
+    }
+    free(workers);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.changed);
+  }
+
+  for(i = 0; i < walk.ncomps; i++)
+    free(walk.literal[i]);
+  free(walk.literal);
+  free(walk.comps);
+  free(copy);
+  return list -> count;
+}
+
+void glob_free(struct glob_list *list) {
+  struct block *b;
+
+  while((b = list -> blocks) != NULL) {
+    list -> blocks = b -> next;
+    free(b);
+  }
+  free(list -> paths);
+  list -> paths = NULL;
+  list -> count = 0;
+}
+
+/*........................ end of glob.c ....................................*/
@@ -0,0 +1,27 @@
+/******************************************************************************
+ *
+ *  File Name........: glob.h
+ *
+ *  Description......: header file for the glob expansion of ush.
+ *
+ *****************************************************************************/
+
+#ifndef GLOB_H
+#define GLOB_H
+
+// the sorted matches of a pattern
+struct glob_list {
+  char **paths;			// NULL terminated
+  int count;
+  struct block *blocks;		// where the paths are kept
+};
+
+// Tells if a pattern has *, ? or [...] outside of backslash escapes
+int glob_has_magic(const char *pattern);
+
+// Expands a pattern, returns the number of matches
+int glob_expand(const char *pattern, struct glob_list *list);
+void glob_free(struct glob_list *list);
+
+#endif /* GLOB_H */
+/*........................ end of glob.h ....................................*/
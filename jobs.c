@@ -0,0 +1,511 @@
+/******************************************************************************
+ *
+ *  File Name........: jobs.c
+ *
+ *  Description......:
+ *	The job table of ush.  Every pipeline the shell starts is a job: a
+ *  process group with one process per stage.  Foreground jobs are waited
+ *  for right away, background jobs (a line ending in &) stay in the table
+ *  until they are done.
+ *
+ *  The processes of a job are watched by the event loop (events.c),
+ *  which reaps them and tells the job when one of them stopped,
+ *  continued or ended.  Waiting for a job is running the loop until the
+ *  job is done or stopped, so nothing is polled and no wait can take the
+ *  status of a child that belongs to someone else.
+ *
+ *  The resource usage of each stage is kept with the job for the time
+ *  builtin.
+ *
+ *  A job started by the timeout builtin has a timer in the loop.  When
+ *  it goes off the job's process group is sent the signal, and SIGKILL
+ *  once the grace period is over too.  Nothing is looked at in between,
+ *  a job that is waiting for its deadline costs nothing.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "jobs.h"
+#include "events.h"
+#include "trace.h"
+
+static Job job_list = NULL;
+static Job current_job = NULL;	// the job fg and bg use by default
+static int job_control = 0;	// the shell hands the terminal to its jobs
+static pid_t shell_pgid;
+
+static const char *state_names[] = {"Running", "Stopped", "Done"};
+
+static void process_changed(pid_t pid, int status, const struct rusage *usage, void *job);
+
+// Converts a status returned by waitpid into a shell exit status
+static int exit_status(int status) {
+  if(WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if(WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+// Hands the terminal to the process group pgid, but only when the shell
+// is interactive and owns the terminal in the first place
+static void give_terminal_to(pid_t pgid) {
+  if(!job_control)
+    return;
+  tcsetpgrp(STDIN_FILENO, pgid);
+}
+
+/*
+ * Sets up job handling
+ * The event loop is set up before any child is started.  When the shell
+ * reads from a terminal it keeps the terminal between jobs, so it must
+ * not be stopped by the job control signals itself.
+ */
+void jobs_init(int interactive) {
+  events_init();
+
+  job_control = interactive;
+  if(job_control) {
+    shell_pgid = getpgrp();
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+  }
+}
+
+// In a child of the shell that runs a built in command as a pipeline
+// stage.  The pipeline has the terminal, the commands the stage starts
+// stay in its process group and must not take it.
+void jobs_child() {
+  job_control = 0;
+}
+
+Job job_create(const char *command) {
+  Job j, *tail;
+  int id = 0;
+
+  for(tail = &job_list; *tail != NULL; tail = &(*tail) -> next)
+    if((*tail) -> id > id)
+      id = (*tail) -> id;
+
+  j = calloc(1, sizeof(*j));
+  j -> id = id + 1;
+  j -> command = strdup(command);
+  j -> state = Jrunning;
+  j -> status = 127;
+  clock_gettime(CLOCK_MONOTONIC, &j -> start);
+  *tail = j;
+  return j;
+}
+
+// Adds the process of a stage to the job, pid is -1 if the stage could
+// not be started.  Stages are added in order, the last one counts.
+// name is the command of the stage, for timeout to tell.
+void job_add_process(Job j, pid_t pid, const char *name) {
+  j -> last = pid;
+  if(pid <= 0)
+    return;
+  if(j -> pgid == 0)
+    j -> pgid = pid;
+  j -> pids = realloc(j -> pids, (j -> npids + 1) * sizeof(pid_t));
+  j -> usage = realloc(j -> usage, (j -> npids + 1) * sizeof(struct rusage));
+  memset(&j -> usage[j -> npids], 0, sizeof(struct rusage));
+  j -> ended = realloc(j -> ended, (j -> npids + 1) * sizeof(int));
+  j -> ended[j -> npids] = 0;
+  j -> names = realloc(j -> names, (j -> npids + 1) * sizeof(char *));
+  j -> names[j -> npids] = strdup(name);
+  j -> pids[j -> npids++] = pid;
+  j -> alive++;
+  event_child(pid, process_changed, j);
+}
+
+void job_delete(Job j) {
+  Job *p;
+  int i;
+
+  for(p = &job_list; *p != NULL; p = &(*p) -> next) {
+    if(*p == j) {
+      *p = j -> next;
+      break;
+    }
+  }
+  if(current_job == j) {
+    // the most recent background job becomes the current one
+    current_job = NULL;
+    for(p = &job_list; *p != NULL; p = &(*p) -> next)
+      if((*p) -> background)
+        current_job = *p;
+  }
+  event_remove(j -> deadline);
+  for(i = 0; i < j -> npids; i++)
+    free(j -> names[i]);
+  free(j -> names);
+  free(j -> pids);
+  free(j -> usage);
+  free(j -> ended);
+  free(j -> command);
+  free(j);
+}
+
+// Records a state change of one of the job's processes, usage is what
+// the process used if it is done
+static void record_status(Job j, pid_t pid, int status, const struct rusage *usage) {
+  int i;
+
+  if(WIFSTOPPED(status))
+    trace_instant("stopped", pid, WSTOPSIG(status));
+  else if(WIFCONTINUED(status))
+    trace_instant("continued", pid, TRACE_NONE);
+  else
+    trace_instant("exit", pid, exit_status(status));
+
+  if(WIFSTOPPED(status)) {
+    if(j -> state != Jstopped)
+      j -> notify = 1;
+    j -> state = Jstopped;
+    j -> stop_signal = WSTOPSIG(status);
+    return;
+  }
+  if(WIFCONTINUED(status)) {
+    j -> state = Jrunning;
+    return;
+  }
+
+  j -> alive--;
+  for(i = 0; i < j -> npids; i++) {
+    if(j -> pids[i] == pid) {
+      j -> usage[i] = *usage;
+      j -> ended[i] = 1;
+    }
+  }
+  if(pid == j -> last)
+    j -> status = exit_status(status);
+  if(j -> alive == 0) {
+    j -> state = Jdone;
+    j -> notify = 1;
+    event_remove(j -> deadline);
+    j -> deadline = NULL;
+    // The status timeout(1) exits with
+    if(j -> timed_out)
+      j -> status = j -> timed_out > 1 ? 128 + SIGKILL : 124;
+  }
+}
+
+// Tells which stages of a job are still running and what they are sent
+static void report_running(Job j, int signal) {
+  int i;
+
+  for(i = 0; i < j -> npids; i++)
+    if(!j -> ended[i])
+      fprintf(stderr, "  stage %d pid %d (%s) still running, sending SIG%s\n",
+              i + 1, (int)j -> pids[i], j -> names[i], sigabbrev_np(signal));
+}
+
+// Sends a signal to every process of a job
+static void signal_job(Job j, int signal) {
+  int i;
+
+  if(killpg(j -> pgid, signal) == 0)
+    return;
+  // A job started by a pipeline stage has no process group of its own
+  for(i = 0; i < j -> npids; i++)
+    if(!j -> ended[i])
+      kill(j -> pids[i], signal);
+}
+
+// The timer of a job's timeout went off, the first time for the signal,
+// the second time, after the grace period, for SIGKILL
+static void time_up(void *job) {
+  Job j = job;
+
+  event_remove(j -> deadline);
+  j -> deadline = NULL;
+  if(j -> alive == 0)
+    return;
+
+  if(!j -> timed_out) {
+    fprintf(stderr, "timeout: %s: %gs are up\n", j -> command, j -> timeout.seconds);
+    report_running(j, j -> timeout.signal);
+    j -> timed_out = 1;
+    signal_job(j, j -> timeout.signal);
+    // A stopped job would never see the signal
+    if(j -> state == Jstopped)
+      signal_job(j, SIGCONT);
+    if(j -> timeout.grace > 0)
+      j -> deadline = event_timer(j -> timeout.grace, time_up, j);
+  } else {
+    fprintf(stderr, "timeout: %s: still running %gs after SIG%s\n", j -> command,
+            j -> timeout.grace, sigabbrev_np(j -> timeout.signal));
+    report_running(j, SIGKILL);
+    j -> timed_out = 2;
+    signal_job(j, SIGKILL);
+  }
+}
+
+/*
+ * Gives a job a deadline, counted from now
+ * The whole process group gets the signal when it is up, so every stage
+ * of a pipeline and whatever they started goes.
+ */
+void job_timeout(Job j, const struct timeout *timeout) {
+  if(timeout -> seconds <= 0 || j -> npids == 0)
+    return;
+  j -> timeout = *timeout;
+  j -> deadline = event_timer(timeout -> seconds, time_up, j);
+}
+
+// The event loop's handler for the processes of jobs
+static void process_changed(pid_t pid, int status, const struct rusage *usage, void *job) {
+  record_status(job, pid, status, usage);
+}
+
+static void print_job(Job j, int long_format) {
+  struct timespec now;
+
+  printf("[%d]  %c ", j -> id, j == current_job ? '+' : ' ');
+  if(long_format) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%-7d %5lds ", (int)j -> pgid, (long)(now.tv_sec - j -> start.tv_sec));
+  }
+  if(j -> state == Jdone && j -> status != 0)
+    printf("Exit %-5d %s\n", j -> status, j -> command);
+  else
+    printf("%-10s%s\n", state_names[j -> state], j -> command);
+}
+
+/*
+ * Waits for a foreground job
+ * The job gets the terminal until it is done or stopped.  A job that is
+ * done is deleted, a stopped job stays in the table and can be resumed
+ * with fg or bg.  Returns the exit status of the job.
+ */
+int job_wait(Job j) {
+  int status;
+
+  j -> background = 0;
+  if(j -> npids == 0) {
+    status = j -> status;
+    job_delete(j);
+    return status;
+  }
+
+  give_terminal_to(j -> pgid);
+  trace_begin("wait", j -> command);
+  while(j -> alive > 0 && j -> state != Jstopped)
+    events_run(-1);
+  trace_end("wait", j -> pgid, j -> status);
+  // Take the terminal back from the job
+  give_terminal_to(shell_pgid);
+
+  if(j -> state == Jstopped) {
+    j -> background = 1;
+    j -> notify = 0;
+    current_job = j;
+    printf("\n");
+    print_job(j, 0);
+    return 128 + j -> stop_signal;
+  }
+
+  status = j -> status;
+  if(j -> timed)
+    job_print_times(j);
+  job_delete(j);
+  return status;
+}
+
+// The job was started with & and runs on while the shell reads commands
+void job_background(Job j) {
+  j -> background = 1;
+  current_job = j;
+  if(job_control)
+    printf("[%d] %d\n", j -> id, (int)j -> pgid);
+}
+
+// Continues a stopped job, fg and bg
+int job_continue(Job j, int foreground) {
+  if(j -> state == Jdone)
+    return j -> status;
+
+  if(foreground)
+    printf("%s\n", j -> command);
+  else
+    printf("[%d]    %s &\n", j -> id, j -> command);
+
+  killpg(j -> pgid, SIGCONT);
+  j -> state = Jrunning;
+  if(foreground)
+    return job_wait(j);
+  j -> background = 1;
+  current_job = j;
+  return 0;
+}
+
+// Takes in what happened to the children so far, without waiting
+void jobs_reap() {
+  events_run(0);
+}
+
+// Waits until a background job is done (the wait builtin)
+int job_wait_background(Job j) {
+  int status;
+
+  while(j -> state != Jdone)
+    events_run(-1);
+  status = j -> status;
+  if(j -> timed)
+    job_print_times(j);
+  job_delete(j);
+  return status;
+}
+
+// Waits for every background job, returns the status of the last one
+int jobs_wait_all() {
+  int status = 0;
+  Job j;
+
+  for(j = job_list; j != NULL; j = job_list) {
+    while(j != NULL && !j -> background)
+      j = j -> next;
+    if(j == NULL)
+      break;
+    status = job_wait_background(j);
+  }
+  return status;
+}
+
+// Tells the user about background jobs that stopped or finished,
+// done before each prompt and each line of a script, which only drops
+// the jobs that are done
+void jobs_notify() {
+  Job j, next;
+
+  jobs_reap();
+  for(j = job_list; j != NULL; j = next) {
+    next = j -> next;
+    // Without job control nothing is reported, the jobs that are done
+    // are only dropped so that a script's list does not keep growing
+    if(!job_control && j -> background && j -> state == Jdone) {
+      job_delete(j);
+      continue;
+    }
+    if(!job_control || !j -> background || !j -> notify)
+      continue;
+    j -> notify = 0;
+    print_job(j, 0);
+    if(j -> state == Jdone)
+      job_delete(j);
+  }
+}
+
+// The jobs builtin, jobs that are done are reported once
+void jobs_print(int long_format) {
+  Job j, next;
+
+  jobs_reap();
+  for(j = job_list; j != NULL; j = next) {
+    next = j -> next;
+    if(!j -> background)
+      continue;
+    print_job(j, long_format);
+    if(j -> state == Jdone)
+      job_delete(j);
+    else
+      j -> notify = 0;
+  }
+}
+
+// Adds the usage of one process to a sum
+// The sum of the max RSS is what the stages of a pipeline can hold at once
+void rusage_add(struct rusage *sum, const struct rusage *usage) {
+  timeradd(&sum -> ru_utime, &usage -> ru_utime, &sum -> ru_utime);
+  timeradd(&sum -> ru_stime, &usage -> ru_stime, &sum -> ru_stime);
+  sum -> ru_maxrss += usage -> ru_maxrss;
+  sum -> ru_majflt += usage -> ru_majflt;
+  sum -> ru_minflt += usage -> ru_minflt;
+  sum -> ru_nvcsw += usage -> ru_nvcsw;
+  sum -> ru_nivcsw += usage -> ru_nivcsw;
+}
+
+// Prints what the time builtin reports, to stderr like any shell does
+// real is the wall clock time, left out if it is negative
+void rusage_print(const char *label, double real, const struct rusage *usage) {
+  fprintf(stderr, "%s", label);
+  if(real >= 0)
+    fprintf(stderr, "%.3fs real  ", real);
+  fprintf(stderr, "%ld.%03lds user  %ld.%03lds sys  %ld KB maxrss  "
+          "%ld/%ld faults  %ld/%ld ctxsw\n",
+          (long)usage -> ru_utime.tv_sec, (long)usage -> ru_utime.tv_usec / 1000,
+          (long)usage -> ru_stime.tv_sec, (long)usage -> ru_stime.tv_usec / 1000,
+          usage -> ru_maxrss, usage -> ru_majflt, usage -> ru_minflt,
+          usage -> ru_nvcsw, usage -> ru_nivcsw);
+}
+
+/*
+ * Reports the times of a job that is done, for the time builtin
+ * The first line is the whole job, a pipeline gets a line for each stage
+ * after it so the slow one can be found.  Faults are major/minor and
+ * context switches voluntary/involuntary.
+ */
+void job_print_times(Job j) {
+  struct timespec now;
+  struct rusage total;
+  char label[32];
+  double real;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  real = (now.tv_sec - j -> start.tv_sec) + (now.tv_nsec - j -> start.tv_nsec) / 1e9;
+
+  memset(&total, 0, sizeof(total));
+  for(i = 0; i < j -> npids; i++)
+    rusage_add(&total, &j -> usage[i]);
+  rusage_print("", real, &total);
+
+  if(j -> npids < 2)
+    return;
+  for(i = 0; i < j -> npids; i++) {
+    snprintf(label, sizeof(label), "  stage %d pid %d: ", i + 1, (int)j -> pids[i]);
+    // A stage has no wall time of its own, only what it used
+    rusage_print(label, -1, &j -> usage[i]);
+  }
+}
+
+/*
+ * Finds a job by its name
+ * %n is job n, % %% %+ and no name at all are the current job and a
+ * plain number is the pid of one of the job's processes
+ */
+Job job_find(const char *spec) {
+  Job j;
+  pid_t pid;
+  int i, id;
+
+  if(spec == NULL || !strcmp(spec, "%") || !strcmp(spec, "%%") || !strcmp(spec, "%+"))
+    return current_job;
+
+  if(spec[0] == '%') {
+    id = atoi(spec + 1);
+    for(j = job_list; j != NULL; j = j -> next)
+      if(j -> background && j -> id == id)
+        return j;
+    return NULL;
+  }
+
+  pid = atoi(spec);
+  for(j = job_list; j != NULL; j = j -> next)
+    for(i = 0; i < j -> npids; i++)
+      if(j -> background && j -> pids[i] == pid)
+        return j;
+  return NULL;
+}
+
+/*........................ end of jobs.c ....................................*/
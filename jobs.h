@@ -0,0 +1,78 @@
+/******************************************************************************
+ *
+ *  File Name........: jobs.h
+ *
+ *  Description......: header file for the job table of ush.
+ *
+ *****************************************************************************/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "events.h"
+
+/* a deadline for a job, what timeout in front of a pipe asks for */
+struct timeout {
+  double seconds;		/* 0 for none */
+  int signal;			/* sent to the job when the time is up */
+  double grace;			/* SIGKILL follows this much later, 0 never */
+};
+
+/* state of a job */
+typedef enum {Jrunning, Jstopped, Jdone} JobState;
+
+/* job data structure
+ * one job_t for each pipeline that was started, linked list
+ */
+struct job_t {
+  int id;			/* the n of %n */
+  pid_t pgid;			/* process group, pid of the first stage */
+  pid_t *pids;			/* one pid for each stage that was started */
+  struct rusage *usage;		/* what each stage used, once it is done */
+  int *ended;			/* which stages are done */
+  char **names;			/* the command of each stage */
+  int npids, alive;
+  pid_t last;			/* last stage, the job's status is its status */
+  int status;			/* exit status once the job is done */
+  JobState state;
+  int stop_signal;		/* the signal that stopped it last */
+  int background;		/* not waited for by the shell */
+  int notify;			/* state change not reported to the user yet */
+  int timed;			/* times are reported when it is done */
+  struct timespec start;	/* when the job was started */
+  struct timeout timeout;
+  Event deadline;		/* timer of the timeout, NULL if none */
+  int timed_out;		/* 1 when the signal was sent, 2 after SIGKILL */
+  char *command;		/* command line, for jobs */
+  struct job_t *next;
+};
+typedef struct job_t *Job;
+
+void jobs_init(int interactive);
+void jobs_child(void);
+
+Job job_create(const char *command);
+void job_add_process(Job, pid_t, const char *name);
+void job_delete(Job);
+void job_timeout(Job, const struct timeout *);
+
+int job_wait(Job);
+void job_background(Job);
+int job_continue(Job, int foreground);
+int job_wait_background(Job);
+
+Job job_find(const char *spec);
+void jobs_reap(void);
+void jobs_notify(void);
+void jobs_print(int long_format);
+int jobs_wait_all(void);
+
+void rusage_add(struct rusage *sum, const struct rusage *usage);
+void rusage_print(const char *label, double real, const struct rusage *usage);
+void job_print_times(Job);
+
+#endif /* JOBS_H */
+/*........................ end of jobs.h ....................................*/
@@ -0,0 +1,486 @@
+/******************************************************************************
+ *
+ *  File Name........: launch.c
+ *
+ *  Description......:
+ *	Starts the children of ush.  Programs are started with posix_spawn,
+ *  which does not copy the page tables of the shell the way fork does,
+ *  so launching stays cheap however big the shell grows.  The
+ *  redirections become dup2 file actions.
+ *
+ *  fork is used only when posix_spawn cannot do the job: a nice value
+ *  has to be set, a built in command runs in the child, or the C library
+ *  cannot hand the terminal to the new process group.  In that case exec
+ *  failures are sent back to the parent through a close-on-exec pipe, so
+ *  both paths report ENOENT or EACCES the same way.
+ *
+ *  With USH_ZYGOTE set the shell forks a zygote first thing, while it is
+ *  still small, and has it start every program from then on.  The shell
+ *  sends the path, argv, envp and descriptors over a socketpair; the
+ *  zygote clones with CLONE_PARENT, so the program is a child of the
+ *  shell and is waited for as usual, and answers with the pid.  Requests
+ *  too big for one message are started by the shell itself.  What the
+ *  shell may have changed since the zygote was forked goes with every
+ *  request too: the current directory (as a descriptor), the umask and
+ *  the nice value.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "launch.h"
+#include "trace.h"
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define HAVE_SPAWN_TCSETPGRP
+#endif
+
+// Signals the shell may ignore or block that its children must not inherit
+static const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE};
+
+#define ZYGOTE_MAX	(256 * 1024)	// largest request, path argv and envp
+
+// a request to the zygote, the strings follow it
+struct zygote_request {
+  pid_t pgid;
+  int foreground, priority, file_mask;
+  int nargv, nenvp;
+};
+
+// the answer, error is set if the program could not be started; pid
+// is then a child that exited and still has to be waited for, or 0
+struct zygote_reply {
+  pid_t pid;
+  int error;
+};
+
+static int zygote_fd = -1;	// the shell's end of the socketpair
+
+void spawn_attr_init(struct spawn_attr *attr) {
+  attr -> path = NULL;
+  attr -> argv = NULL;
+  attr -> envp = NULL;
+  attr -> fds[0] = attr -> fds[1] = attr -> fds[2] = -1;
+  attr -> pgid = -1;
+  attr -> foreground = 0;
+  attr -> priority = 0;
+  attr -> dir = -1;
+  attr -> file_mask = -1;
+  attr -> function = NULL;
+  attr -> arg = NULL;
+}
+
+static int needs_fork(const struct spawn_attr *attr) {
+  if(attr -> function != NULL || attr -> priority != 0)
+    return 1;
+#ifndef HAVE_SPAWN_TCSETPGRP
+  if(attr -> foreground)
+    return 1;
+#endif
+  return 0;
+}
+
+static pid_t spawn_posix(const struct spawn_attr *attr, int *error) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t sattr;
+  sigset_t set;
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  pid_t pid;
+  int i, rc;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&sattr);
+
+  if(attr -> pgid >= 0) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&sattr, attr -> pgid);
+  }
+
+  sigemptyset(&set);
+  for(i = 0; i < sizeof(job_signals) / sizeof(job_signals[0]); i++)
+    sigaddset(&set, job_signals[i]);
+  posix_spawnattr_setsigdefault(&sattr, &set);
+  sigemptyset(&set);
+  posix_spawnattr_setsigmask(&sattr, &set);
+  posix_spawnattr_setflags(&sattr, flags);
+
+#ifdef HAVE_SPAWN_TCSETPGRP
+  // Before the redirections, stdin is still the terminal here
+  if(attr -> foreground)
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+  for(i = 0; i < 3; i++)
+    if(attr -> fds[i] >= 0 && attr -> fds[i] != i)
+      posix_spawn_file_actions_adddup2(&actions, attr -> fds[i], i);
+
+  rc = posix_spawn(&pid, attr -> path, &actions, &sattr, attr -> argv, attr -> envp);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&sattr);
+
+  if(rc != 0) {
+    *error = rc;
+    return -1;
+  }
+  return pid;
+}
+
+// Sets up the child after fork the way spawn_posix() does
+static void setup_forked_child(const struct spawn_attr *attr) {
+  sigset_t set;
+  int i;
+
+  if(attr -> pgid >= 0)
+    setpgid(0, attr -> pgid);
+  // SIGTTOU is still ignored or blocked here, taking the terminal is safe
+  if(attr -> foreground)
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+
+  for(i = 0; i < sizeof(job_signals) / sizeof(job_signals[0]); i++)
+    signal(job_signals[i], SIG_DFL);
+  sigemptyset(&set);
+  sigprocmask(SIG_SETMASK, &set, NULL);
+
+  for(i = 0; i < 3; i++)
+    if(attr -> fds[i] >= 0 && attr -> fds[i] != i)
+      dup2(attr -> fds[i], i);
+
+  if(attr -> priority != 0)
+    setpriority(PRIO_PROCESS, 0, attr -> priority);
+  if(attr -> dir >= 0)
+    fchdir(attr -> dir);
+  if(attr -> file_mask >= 0)
+    umask(attr -> file_mask);
+}
+
+/*
+ * Forks (or for the zygote clones as a sibling) and execs
+ * With clone_parent the child belongs to our parent, which has to wait
+ * for it; *failed is the pid of a child that could not exec then.
+ */
+static pid_t spawn_fork(const struct spawn_attr *attr, int *error, int clone_parent,
+                        pid_t *failed) {
+  int err_pipe[2];
+  int child_errno;
+  ssize_t n;
+  pid_t pid;
+
+  if(pipe2(err_pipe, O_CLOEXEC) < 0) {
+    *error = errno;
+    return -1;
+  }
+
+  if(clone_parent)
+    pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+  else
+    pid = fork();
+  if(pid < 0) {
+    *error = errno;
+    close(err_pipe[0]);
+    close(err_pipe[1]);
+    return -1;
+  }
+
+  if(pid == 0) {
+    close(err_pipe[0]);
+    setup_forked_child(attr);
+
+    if(attr -> function != NULL) {
+      // A built in command: it gets stdin, stdout and stderr and nothing
+      // else, as if it had been exec'd
+      zygote_child();
+      close_range(3, ~0U, 0);
+      _exit(attr -> function(attr -> arg));
+    }
+
+    execve(attr -> path, attr -> argv, attr -> envp);
+    child_errno = errno;
+    write(err_pipe[1], &child_errno, sizeof(child_errno));
+    _exit(127);
+  }
+
+  // The write end closes on exec, so nothing to read means success
+  close(err_pipe[1]);
+  do {
+    n = read(err_pipe[0], &child_errno, sizeof(child_errno));
+  } while(n < 0 && errno == EINTR);
+  close(err_pipe[0]);
+
+  if(n == sizeof(child_errno)) {
+    if(clone_parent)
+      *failed = pid;
+    else
+      waitpid(pid, NULL, 0);
+    *error = child_errno;
+    return -1;
+  }
+  return pid;
+}
+
+static int put_strings(char *buffer, int *len, char **strings) {
+  int n;
+
+  for(n = 0; strings[n] != NULL; n++) {
+    int size = strlen(strings[n]) + 1;
+    if(*len + size > ZYGOTE_MAX)
+      return -1;
+    memcpy(buffer + *len, strings[n], size);
+    *len += size;
+  }
+  return n;
+}
+
+// Points strings[] at the NUL terminated strings at *p
+static void get_strings(char **p, char **strings, int n) {
+  int i;
+
+  for(i = 0; i < n; i++) {
+    strings[i] = *p;
+    *p += strlen(*p) + 1;
+  }
+  strings[n] = NULL;
+}
+
+// Serves the shell until it closes its end of the socketpair
+static void zygote_loop(int fd) {
+  static char buffer[ZYGOTE_MAX];
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  struct zygote_request request;
+  struct zygote_reply reply;
+  struct spawn_attr attr;
+  struct msghdr msg;
+  struct iovec iov[2];
+  struct cmsghdr *cmsg;
+  char **argv, **envp, *p;
+  int fds[4], i, nfds;
+  pid_t failed;
+  ssize_t n;
+
+  while(1) {
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &request;
+    iov[0].iov_len = sizeof(request);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = sizeof(buffer) - 1;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      _exit(0);
+    buffer[n - sizeof(request)] = '\0';
+
+    nfds = 0;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg != NULL && cmsg -> cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg -> cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if(nfds > 4)
+        nfds = 4;
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+
+    spawn_attr_init(&attr);
+    argv = malloc((request.nargv + 1) * sizeof(char *));
+    envp = malloc((request.nenvp + 1) * sizeof(char *));
+    p = buffer;
+    attr.path = p;
+    p += strlen(p) + 1;
+    get_strings(&p, argv, request.nargv);
+    get_strings(&p, envp, request.nenvp);
+    attr.argv = argv;
+    attr.envp = envp;
+    attr.pgid = request.pgid;
+    attr.foreground = request.foreground;
+    attr.priority = request.priority;
+    attr.file_mask = request.file_mask;
+    for(i = 0; i < nfds && i < 3; i++)
+      attr.fds[i] = fds[i];
+    if(nfds == 4)
+      attr.dir = fds[3];
+
+    reply.error = 0;
+    failed = 0;
+    reply.pid = spawn_fork(&attr, &reply.error, 1, &failed);
+    if(reply.pid < 0)
+      reply.pid = failed;
+    write(fd, &reply, sizeof(reply));
+
+    for(i = 0; i < nfds; i++)
+      close(fds[i]);
+    free(argv);
+    free(envp);
+  }
+}
+
+/*
+ * Forks the zygote, to be done before the shell grows
+ * Returns 0, or -1 if there is none and the shell starts programs itself.
+ */
+int zygote_start() {
+  int sv[2];
+  pid_t pid;
+
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+  pid = fork();
+  if(pid < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if(pid == 0) {
+    close(sv[0]);
+    // Only the shell reacts to these, the zygote lives until the shell
+    // closes the socketpair
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    zygote_loop(sv[1]);
+  }
+  close(sv[1]);
+  zygote_fd = sv[0];
+  return 0;
+}
+
+// A forked child of the shell lets go of the shell's zygote and starts
+// its programs itself, the replies to its requests could go to the shell
+void zygote_child() {
+  if(zygote_fd >= 0)
+    close(zygote_fd);
+  zygote_fd = -1;
+}
+
+/*
+ * Has the zygote start a program
+ * Returns the pid, or -1 with *error set.  *error is -1 if the request
+ * could not be sent and the caller should start the program itself.
+ */
+pid_t zygote_spawn(const struct spawn_attr *attr, int *error) {
+  static char *buffer = NULL;
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  struct zygote_request request;
+  struct zygote_reply reply;
+  struct msghdr msg;
+  struct iovec iov[2];
+  struct cmsghdr *cmsg;
+  int fds[4], len, i, rc;
+  ssize_t n;
+
+  *error = -1;
+  if(zygote_fd < 0)
+    return -1;
+  if(buffer == NULL && (buffer = malloc(ZYGOTE_MAX)) == NULL)
+    return -1;
+
+  len = strlen(attr -> path) + 1;
+  memcpy(buffer, attr -> path, len);
+  request.nargv = put_strings(buffer, &len, attr -> argv);
+  request.nenvp = put_strings(buffer, &len, attr -> envp);
+  if(request.nargv < 0 || request.nenvp < 0)
+    return -1;
+  request.pgid = attr -> pgid;
+  request.foreground = attr -> foreground;
+  // The zygote still has the nice value, umask and directory the shell
+  // started with, the program gets the shell's current ones
+  request.priority = attr -> priority != 0 ? attr -> priority : getpriority(PRIO_PROCESS, 0);
+  request.file_mask = umask(0);
+  umask(request.file_mask);
+  fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if(fds[3] < 0)
+    return -1;
+  // The zygote's own 0, 1 and 2 are whatever the shell had when it
+  // started, so the ones the program inherits are always sent
+  for(i = 0; i < 3; i++)
+    fds[i] = attr -> fds[i] >= 0 ? attr -> fds[i] : i;
+
+  memset(&msg, 0, sizeof(msg));
+  iov[0].iov_base = &request;
+  iov[0].iov_len = sizeof(request);
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  memset(control, 0, sizeof(control));
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg -> cmsg_level = SOL_SOCKET;
+  cmsg -> cmsg_type = SCM_RIGHTS;
+  cmsg -> cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  rc = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+  close(fds[3]);
+  if(rc < 0)
+    return -1;
+  do {
+    n = read(zygote_fd, &reply, sizeof(reply));
+  } while(n < 0 && errno == EINTR);
+  if(n != sizeof(reply)) {
+    // The zygote is gone, start programs here from now on
+    close(zygote_fd);
+    zygote_fd = -1;
+    return -1;
+  }
+
+  if(reply.error != 0) {
+    if(reply.pid > 0)
+      waitpid(reply.pid, NULL, 0);
+    *error = reply.error;
+    return -1;
+  }
+  *error = 0;
+  return reply.pid;
+}
+
+pid_t spawn_process(const struct spawn_attr *attr, int *error) {
+  pid_t pid;
+
+  // Nothing buffered may be written twice, or after the child's output
+  fflush(NULL);
+
+  pid = -1;
+  *error = -1;
+  if(zygote_fd >= 0 && attr -> function == NULL) {
+    trace_begin("zygote", attr -> path);
+    pid = zygote_spawn(attr, error);
+    trace_end("zygote", pid, TRACE_NONE);
+  }
+  if(pid < 0 && *error == -1) {
+    *error = 0;
+    if(needs_fork(attr)) {
+      trace_begin("fork", attr -> path);
+      pid = spawn_fork(attr, error, 0, NULL);
+      trace_end("fork", pid, TRACE_NONE);
+    } else {
+      trace_begin("posix_spawn", attr -> path);
+      pid = spawn_posix(attr, error);
+      trace_end("posix_spawn", pid, TRACE_NONE);
+    }
+  }
+
+  // Put the child in its group here too, whoever runs first wins
+  if(pid > 0 && attr -> pgid >= 0)
+    setpgid(pid, attr -> pgid == 0 ? pid : attr -> pgid);
+  return pid;
+}
+
+/*........................ end of launch.c ..................................*/
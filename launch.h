@@ -0,0 +1,45 @@
+/******************************************************************************
+ *
+ *  File Name........: launch.h
+ *
+ *  Description......: header file for the process launch layer of ush.
+ *
+ *****************************************************************************/
+
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <sys/types.h>
+
+/* what to start and how
+ * fill in with spawn_attr_init() and change what is needed
+ */
+struct spawn_attr {
+  const char *path;		/* program to execute */
+  char **argv;			/* its arguments */
+  char **envp;			/* its environment */
+  int fds[3];			/* become stdin, stdout, stderr; -1 inherits */
+  pid_t pgid;			/* group to join, 0 starts a new one, -1 none */
+  int foreground;		/* the new group gets the terminal */
+  int priority;			/* nice value, 0 keeps the shell's */
+  int dir;			/* directory to run in, -1 the shell's */
+  int file_mask;		/* umask, -1 the shell's */
+  int (*function)(void *);	/* run in the child instead of path */
+  void *arg;			/* argument for function */
+};
+
+void spawn_attr_init(struct spawn_attr *);
+
+/* Starts a child and returns its pid.  Returns -1 and sets *error to the
+ * errno of the failure if the child could not be started or the program
+ * could not be executed (ENOENT, EACCES, ...).
+ */
+pid_t spawn_process(const struct spawn_attr *, int *error);
+
+/* The zygote starts programs for the shell when it runs, see launch.c */
+int zygote_start(void);
+pid_t zygote_spawn(const struct spawn_attr *, int *error);
+void zygote_child(void);
+
+#endif /* LAUNCH_H */
+/*........................ end of launch.h ...................................*/
@@ -8,6 +8,7 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -19,58 +20,164 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include "parse.h"
+#include "pathhash.h"
+#include "launch.h"
+#include "jobs.h"
+#include "trace.h"
+#include "copy.h"
+#include "utils.h"
+#include "parallel.h"
+#include "server.h"
+#include "env.h"
+#include "glob.h"
+#include "script.h"
+#include "events.h"
 
 // Global Variables which hold hostname, user's directory and current directory
-char *hostname;
-char *homedir;
-char *current_dir;
-
-// Environment Variables Available
-extern char **environ;
-
-char *built_in_commands[] = {"echo", "cd", "pwd", "logout", "setenv", "unsetenv", "where", 0};
+// None is looked up before it is needed, see host_name(), home_dir() and
+// working_dir()
+char *hostname = NULL;
+char *homedir = NULL;
+char *current_dir = NULL;
+
+// Set by --startup-stats, the shell then tells on stderr how long each
+// phase of its start took
+int startup_stats = 0;
+struct timespec startup_time, phase_time;
+
+// Exit status of the last command or pipeline
+int last_status = 0;
+
+// Set while a pipe prefixed with time runs, its job reports its times
+int timing = 0;
+
+// Set while a pipe prefixed with timeout runs, its job gets the deadline
+struct timeout deadline;
+
+// Set in the child that runs a built in command as a pipeline stage
+int in_stage = 0;
+
+// Set when the shell reads commands from a terminal, the shell then owns
+// the terminal and hands it to each pipeline it runs
+int interactive = 0;
+
+// Set while the lines come from the image of a compiled script
+int from_image = 0;
+
+// A built in command
+// flags tell where it may run: BI_PARENT in the shell itself, BI_PIPELINE
+// as a stage of its own, BI_FORK if it starts a child of its own to run
+// the command given as its arguments.  In a pipeline of several commands
+// any of them runs in the stage's child, one that changes the shell (cd,
+// fg) then only changes that child.  BI_FILES runs in the shell
+// only when it copies regular files into a regular file, anything else
+// could keep it reading for ever and it runs as a stage.  BI_LONG may
+// keep going for long, an interactive shell runs it as a stage so that
+// it can be stopped and the prompt is not held up
+#define BI_PARENT   1
+#define BI_PIPELINE 2
+#define BI_FORK     4
+#define BI_FILES    8
+#define BI_LONG     16
+
+struct built_in {
+  const char *name;
+  void (*handler)(Cmd);
+  int flags;
+  const char *help;
+};
+
+const struct built_in *find_built_in(const char *command_name);
+
+// Milliseconds from since to now, since is set to now
+double lap_ms(struct timespec *since) {
+  struct timespec now;
+  double ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (now.tv_sec - since -> tv_sec) * 1e3 + (now.tv_nsec - since -> tv_nsec) / 1e6;
+  *since = now;
+  return ms;
+}
 
-int is_built_in_command(const char *command_name) {
-  int i = 0;
-  char *current = built_in_commands[i];
+// With --startup-stats tells how long a phase of the start took, it began
+// where the phase before it ended
+void startup_phase(const char *name) {
+  if(startup_stats)
+    fprintf(stderr, "ush: startup %-8s %8.3f ms\n", name, lap_ms(&phase_time));
+}
 
-  while(current != NULL) {
-    if(!strcmp(command_name, current))
-      return 1;
-    i++;
-    current = built_in_commands[i];
-  }
-  return 0;
+// Ends the start, right before the first command is read
+void startup_done() {
+  if(startup_stats)
+    fprintf(stderr, "ush: startup %-8s %8.3f ms\n", "total", lap_ms(&startup_time));
 }
 
 /*
  * initializes the shell
- * Mainly setsup the hostname and user's home directory which is also the current directory
+ * Only the environment is loaded here.  The hostname, the home directory
+ * and the current directory are looked up when they are first used, which
+ * a shell running a script or -c may never do.
 */
 void init() {
-  struct passwd *pw;
+  // The environment is kept by env.c from now on
+  env_init();
+}
 
+// The hostname, looked up when the first prompt is shown
+const char *host_name() {
+  char name[HOST_NAME_MAX + 1];
+  struct timespec start;
 
-  // Get the hostname
-  hostname = (char *)malloc(1024 * sizeof(char));
   if(hostname == NULL) {
-    exit(1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(gethostname(name, sizeof(name)) < 0)
+      strcpy(name, "ush");
+    name[HOST_NAME_MAX] = '\0';
+    hostname = strdup(name);
+    if(startup_stats)
+      fprintf(stderr, "ush: lookup  hostname %8.3f ms\n", lap_ms(&start));
   }
-  gethostname(hostname, 1024);
-  hostname = realloc(hostname, strlen(hostname) + 1);
+  return hostname;
+}
 
-  // Get the user's home directory
-  pw = getpwuid(getuid());
-  homedir = (char *)malloc((strlen(pw->pw_dir) + 1) * sizeof(char));
-  homedir = strcpy(homedir, pw -> pw_dir);
+/*
+ * The user's home directory
+ * $HOME when it is set, like other shells.  Only without it the password
+ * database is asked, which can go through NSS to LDAP or sssd, and that
+ * answer is kept.
+ */
+const char *home_dir() {
+  const char *home = env_get("HOME");
+  struct passwd *pw;
+  struct timespec start;
+
+  if(home != NULL && home[0] != '\0')
+    return home;
+  if(homedir == NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pw = getpwuid(getuid());
+    homedir = strdup(pw != NULL ? pw -> pw_dir : "/");
+    if(startup_stats)
+      fprintf(stderr, "ush: lookup  passwd   %8.3f ms\n", lap_ms(&start));
+  }
+  return homedir;
+}
 
-  // Get the current directory
-  current_dir = (char *)malloc((4 * 1024) * sizeof(char));
-  if(current_dir == NULL)
-    exit(-1);
-  getcwd(current_dir, 4 * 1024);
-  current_dir = realloc(current_dir, strlen(current_dir) + 1);
+// The current directory, asked from the kernel the first time it is needed
+// and then kept up to date by cd
+const char *working_dir() {
+  if(current_dir == NULL) {
+    current_dir = getcwd(NULL, 0);
+    if(current_dir == NULL)
+      current_dir = strdup("/");
+  }
+  return current_dir;
 }
 
 /*
@@ -85,8 +192,10 @@ void change_current_directory(char *path) {
   struct stat sb;
   // If the path is null, we revert back to home directory
   if((path == NULL) || (strlen(path) == 0)) {
-    strcpy(current_dir, homedir);
-    setenv("PWD", current_dir, 1);
+    effective_dest = strdup(home_dir());
+    free(current_dir);
+    current_dir = effective_dest;
+    env_set("PWD", current_dir);
     chdir(current_dir);
     return;
   }
@@ -96,6 +205,7 @@ void change_current_directory(char *path) {
     effective_dest = (char *)malloc((strlen(path) + 1) * sizeof(char));
     strcpy(effective_dest, path);
   } else {
+    working_dir();
     // if the current_directory ends in / character we append
     if(current_dir[strlen(current_dir) - 1] == '/') {
       effective_dest = (char *)malloc((strlen(current_dir) + strlen(path) + 1) * sizeof(char));
@@ -125,13 +235,14 @@ void change_current_directory(char *path) {
 
   // The directory exists and it is actually a directory
   // Change the current_dir
-  strcpy(current_dir, effective_dest);
+  free(current_dir);
+  current_dir = effective_dest;
 
   // Update the PWD environment Variable
-  setenv("PWD", current_dir, 1);
+  env_set("PWD", current_dir);
 
   // Call chdir just in case
-  chdir(effective_dest);
+  chdir(current_dir);
 }
 
 /*
@@ -212,34 +323,29 @@ void change_dir(Cmd command) {
 }
 
 // Built in command to print the current directory
-void pwd() {
+void pwd(Cmd command) {
   // Print the current directory
-  printf("%s\n", current_dir);
+  printf("%s\n", working_dir());
 }
 
 // Built in command to logout / exit
-void logout() {
+void logout(Cmd command) {
   // Exit the shell
   exit(0);
 }
 
-void print_all_env_variables() {
-  char *current = *environ;
-  int offset = 0;
-  while(current) {
-    printf("%s\n", current);
-    current = *(environ + offset++);
-  }
-}
-
 void set_environment_variable(char *name, char *value) {
   // We always overide the value of the environment Variables
-  setenv(name, value, 1);
+  env_set(name, value);
+
+  // Commands have to be looked up again in the new PATH
+  if(!strcmp(name, "PATH"))
+    pathhash_flush();
 }
 
 void set_environment(Cmd command) {
   if(command -> nargs == 1) {
-    print_all_env_variables();
+    env_print();
     return;
   } else if(command -> nargs == 2){
     // Set the environment variable to an empty string
@@ -254,7 +360,9 @@ void unset_environment(Cmd command) {
   // If no arguments provided do nothing and silently return
   if(command -> nargs < 2)
     return;
-  unsetenv(command -> args[1]);
+  env_unset(command -> args[1]);
+  if(!strcmp(command -> args[1], "PATH"))
+    pathhash_flush();
 }
 
 // The function returns whether a file is found in the one of the PATH variable
@@ -262,46 +370,20 @@ void unset_environment(Cmd command) {
 // If the file is found, absolute path to the file is returned
 // Otherwise NULL is returned, which denotes that we finished searching everywhere
 // but could not find the file
+// The answer comes from the command hash table, see pathhash.c
 char *locate_in_path(char *file_name) {
-  // Get the value of the PATH variable
-  char *path_variable_value;
-  char *directory_in_path;
-  char *absolute_path;
-
-  // Copy the path variable value in a string
-  path_variable_value = strdup(getenv("PATH"));
+  const char *absolute_path;
 
-  if(path_variable_value == NULL) {
-    // This means that PATH variable was not found
-    // Someone must have deleted this variable
+  trace_begin("locate_in_path", file_name);
+  absolute_path = pathhash_lookup(file_name);
+  trace_end("locate_in_path", TRACE_NONE, TRACE_NONE);
+  if(absolute_path == NULL)
     return NULL;
-  }
-
-  directory_in_path = strtok(path_variable_value, ":");
-  while(directory_in_path != NULL) {
-    if(file_exists(directory_in_path, file_name) == 0) {
-      // We found the file which matches the criteria
-      // Return it
-      absolute_path = (char *)malloc(sizeof(char) *
-        (strlen(directory_in_path) + strlen(file_name) + 2));
-      strcpy(absolute_path, directory_in_path);
-      strcat(absolute_path, "/");
-      strcat(absolute_path, file_name);
-      free(path_variable_value);
-      return absolute_path;
-    }
-    directory_in_path = strtok(NULL, ":");
-  }
-
-  free(path_variable_value);
-  return NULL;
+  return strdup(absolute_path);
 }
 
 void find_where(Cmd command) {
   char *search_term;
-  char *path_value;
-  int path_value_len;
-  char *path_token;
 
   // If where was called with no arguments return
   if(command -> nargs == 1)
@@ -314,97 +396,223 @@ void find_where(Cmd command) {
     return;
 
   // Is it a built in command
-  if(strcmp(search_term, "echo") == 0     ||
-     strcmp(search_term, "cd") == 0       ||
-     strcmp(search_term, "pwd") == 0      ||
-     strcmp(search_term, "logout") == 0   ||
-     strcmp(search_term, "setenv") == 0   ||
-     strcmp(search_term, "unsetenv") == 0 ||
-     strcmp(search_term, "where") == 0) {
+  if(find_built_in(search_term) != NULL) {
        printf("[built-in] %s\n", search_term);
   }
 
-  // Get the path environment variable, it may not be there so be careful
-  if(getenv("PATH") == NULL)
+  // Every match in the PATH directories
+  pathhash_where(search_term);
+}
+
+// Built in hash command
+// With no arguments lists the remembered commands, hash -r forgets them
+// and hash name... looks the names up and remembers them
+void hash_commands(Cmd command) {
+  int i;
+
+  if(command -> nargs == 1) {
+    pathhash_print();
     return;
+  }
+  for(i = 1; i < command -> nargs; i++) {
+    if(!strcmp(command -> args[i], "-r"))
+      pathhash_flush();
+    else if(pathhash_lookup(command -> args[i]) == NULL)
+      fprintf(stderr, "hash: %s: not found\n", command -> args[i]);
+  }
+}
+
+// Built in rehash command, forgets the remembered commands
+void rehash(Cmd command) {
+  pathhash_flush();
+}
+
+// Finds the job named by the first argument of fg and bg
+Job job_argument(Cmd command) {
+  Job job = job_find(command -> nargs > 1 ? command -> args[1] : NULL);
+
+  if(job == NULL)
+    fprintf(stderr, "%s: no such job\n", command -> args[0]);
+  return job;
+}
+
+// Built in jobs command, jobs -l also shows process group and run time
+void list_jobs(Cmd command) {
+  jobs_print(command -> nargs > 1 && !strcmp(command -> args[1], "-l"));
+}
+
+// Built in fg command, resumes a job and waits for it
+void foreground_job(Cmd command) {
+  Job job = job_argument(command);
+
+  if(job != NULL)
+    last_status = job_continue(job, 1);
+}
+
+// Built in bg command, resumes a stopped job in the background
+void background_job(Cmd command) {
+  Job job = job_argument(command);
+
+  if(job != NULL)
+    last_status = job_continue(job, 0);
+}
+
+// Built in wait command
+// With no arguments waits for all background jobs, otherwise for the
+// given jobs (%n) or processes
+void wait_jobs(Cmd command) {
+  Job job;
+  int i;
 
-  // However if path is not empty or NULL, copy it into a buffer
-  // we will be breaking it into tokens
-  path_value_len = strlen(getenv("PATH"));
-  path_value = (char *)malloc((path_value_len + 1) * sizeof(char));
-  strcpy(path_value, getenv("PATH"));
-
-  path_token = strtok(path_value, ":");
-  while(path_token != NULL) {
-    if(file_exists(path_token, search_term) == 0) {
-      if(path_token[strlen(path_token) - 1] == '/')
-        printf("%s%s\n", path_token, search_term);
-      else
-        printf("%s/%s\n", path_token, search_term);
+  if(command -> nargs == 1) {
+    last_status = jobs_wait_all();
+    return;
+  }
+  for(i = 1; i < command -> nargs; i++) {
+    job = job_find(command -> args[i]);
+    if(job == NULL) {
+      fprintf(stderr, "wait: %s: no such job\n", command -> args[i]);
+      last_status = 127;
+      continue;
     }
-    path_token = strtok(NULL, ":");
+    last_status = job_wait_background(job);
   }
-
 }
 
-void execute_non_built_in_command(Cmd command) {
-  // This is the executable file name and it is always absolute
-  // Our goal is to locate this file
+// Finds the executable for a command name
+// A name starting with / is an absolute path, a name with a / in it is
+// relative to the current directory, anything else is looked up in PATH
+// Returns the absolute path (to be freed) or NULL if there is none
+char *resolve_command(char *command_name) {
   char *executable_file_name = NULL;
-  char *command_name = command -> args[0];
 
   // If the command starts with /, it refers to an executable file
   // using the absolute path
   if(command_name[0] == '/') {
     // Treat the entire command as an absolute path
     // Locate the file
-    if(access(command_name, X_OK) == 0) {
-      executable_file_name = malloc((strlen(command_name) + 1) * sizeof(char));
-      strcpy(executable_file_name, command_name);
-    }
+    if(access(command_name, X_OK) == 0)
+      executable_file_name = strdup(command_name);
+    return executable_file_name;
   } else if (strchr(command_name, '/') != NULL) {
     // This should be treated as relative
+    working_dir();
     if(file_exists(current_dir, command_name) == 0) {
-      executable_file_name = (char *)malloc((strlen(current_dir) + strlen(command_name) + 1) * sizeof(char));
+      executable_file_name = (char *)malloc((strlen(current_dir) + strlen(command_name) + 2) * sizeof(char));
       strcpy(executable_file_name, current_dir);
       strcat(executable_file_name, "/");
       strcat(executable_file_name, command_name);
     }
+    return executable_file_name;
   }
 
-  // We did not find this command either as built-in command
-  // nor as an absolute file
-  // nor as a relative file
   // I think it is time to locate this in known locations
-  if(executable_file_name == NULL)
-    executable_file_name = locate_in_path(command_name);
+  return locate_in_path(command_name);
+}
+
+// Tells the user why a command could not be started
+// and sets the exit status the way other shells do
+void report_launch_error(char *command_name, int error) {
+  if(error == ENOENT) {
+    fprintf(stderr, "%s: command not found\n", command_name);
+    last_status = 127;
+  } else {
+    fprintf(stderr, "%s: %s\n", command_name, strerror(error));
+    last_status = 126;
+  }
+}
+
+// Starts a single command in a process group of its own and waits for it
+// A built in pipeline stage keeps it in the group of the pipeline
+void spawn_and_wait(struct spawn_attr *attr, char *command_name, char *command_text) {
+  pid_t pid;
+  int error;
+  Job job;
+
+  attr -> envp = env_envp();
+  attr -> pgid = in_stage ? -1 : 0;
+  attr -> foreground = interactive && !in_stage;
+
+  pid = spawn_process(attr, &error);
+  if(pid < 0) {
+    report_launch_error(command_name, error);
+    return;
+  }
+
+  // Parent (this shell) will wait for the Child, as a job so that it can
+  // be stopped and continued
+  job = job_create(command_text);
+  job -> timed = timing;
+  job_add_process(job, pid, command_name);
+  job_timeout(job, &deadline);
+  last_status = job_wait(job);
+}
+
+// Writes the words of a command into buf, for the job table
+void command_text(Cmd command, char *buf, int size) {
+  int i, len = strlen(buf);
+
+  for(i = 0; i < command -> nargs && len < size - 1; i++)
+    len += snprintf(buf + len, size - len, i ? " %s" : "%s", command -> args[i]);
+}
+
+// fds are the redirections for the child, see struct redirect_plan
+void execute_non_built_in_command(Cmd command, int fds[3]) {
+  // This is the executable file name and it is always absolute
+  // Our goal is to locate this file
+  char *executable_file_name = NULL;
+  char *command_name = command -> args[0];
+  struct spawn_attr attr;
+  char text[256];
 
+  executable_file_name = resolve_command(command_name);
   if(executable_file_name == NULL) {
-    fprintf(stderr, "command not found\n");
+    report_launch_error(command_name, ENOENT);
     return;
   }
 
   // Execute this command
-  // Lets assume that absolute path is provided at the moment
-  int pid;
-  pid = fork();
-  if(pid == 0) {
-      // Child process
-      execve(executable_file_name, command -> args, environ);
-      exit(0);
-  } else {
-    // Parent (this shell) will wait for the Child
-    waitpid(pid, NULL, 0);
-    free(executable_file_name);
-  }
+  spawn_attr_init(&attr);
+  attr.path = executable_file_name;
+  attr.argv = command -> args;
+  memcpy(attr.fds, fds, sizeof(attr.fds));
+  text[0] = '\0';
+  command_text(command, text, sizeof(text));
+  spawn_and_wait(&attr, command_name, text);
+  free(executable_file_name);
 }
 
 
+// Reads the arguments of nice: nice [priority] command...
+// Returns the command to run with its arguments, or NULL if there is
+// only a priority, and the priority in *priority
+char **nice_arguments(Cmd command, int *priority) {
+  // Check if the second argument is priority or not
+  *priority = atoi(command -> args[1]);
+
+  // Brinf the priority to expected levels
+  if(*priority < -20)
+    *priority = -20;
+  if(*priority > 19)
+    *priority = 19;
+
+  if(*priority == 0) {
+    // Priority was not provided   /*Problem witgh parse, set it to 4*/
+    // Means that second argument forward is the command
+    *priority = 4;
+    return command -> args + 1;
+  }
+  if(command -> nargs == 2)
+    return NULL;
+  return command -> args + 2;
+}
+
 void be_nice(Cmd command) {
-  int priority, parsed_priority;
+  int priority;
   char *absolute_path = NULL;
-  int pid;
   char **command_args = NULL;
+  struct spawn_attr attr;
+  char text[256];
 
   // If there are no arguments, we set the nicety of the shell to be 4
   if(command -> nargs == 1) {
@@ -413,333 +621,909 @@ void be_nice(Cmd command) {
     return;
   }
 
-  // Check if the second argument is priority or not
-  priority = atoi(command -> args[1]);
+  command_args = nice_arguments(command, &priority);
+  if(command_args == NULL) {
+    // Only a priority, that is for the shell itself
+    setpriority(PRIO_PROCESS, 0, priority);
+    return;
+  }
 
-  // Brinf the priority to expected levels
-  if(priority < -20)
-    priority = -20;
-  if(priority > 19)
-    priority = 19;
+  absolute_path = resolve_command(command_args[0]);
+  if(absolute_path == NULL) {
+    report_launch_error(command_args[0], ENOENT);
+    return;
+  }
 
-  // Set the priority
-  if(priority == 0)   /*Problem witgh parse, set it to 0*/
-    setpriority(PRIO_PROCESS, 0, 4);
-  else
-    setpriority(PRIO_PROCESS, 0, priority);
+  // Only the command runs with the new priority
+  spawn_attr_init(&attr);
+  attr.path = absolute_path;
+  attr.argv = command_args;
+  attr.priority = priority;
+  text[0] = '\0';
+  command_text(command, text, sizeof(text));
+  spawn_and_wait(&attr, command_args[0], text);
+  free(absolute_path);
+}
 
-  if(priority == 0) {
-    // Priority was not provided
-    // Means that second argument forward is the command is the
-    absolute_path = locate_in_path(command -> args[1]);
-    command_args = command -> args + 1;
+// Runs the program a built in command stands in for, when it was given
+// something only the program knows.  A pipeline stage becomes the
+// program, in the shell it is started like any other command.
+void run_program(Cmd command) {
+  int fds[3] = {-1, -1, -1};
+  char *executable_file_name;
 
-  } else {
-    absolute_path = locate_in_path(command -> args[2]);
-    command_args = command -> args + 2;
+  if(!in_stage) {
+    execute_non_built_in_command(command, fds);
+    return;
+  }
+  executable_file_name = resolve_command(command -> args[0]);
+  if(executable_file_name == NULL) {
+    report_launch_error(command -> args[0], ENOENT);
+    return;
   }
+  execve(executable_file_name, command -> args, env_envp());
+  report_launch_error(command -> args[0], errno);
+}
 
-  // Fork
-  pid = fork();
-  if(pid == 0) {
-    execve(absolute_path, command_args, environ);
-    exit(0);
-  } else {
-    waitpid(pid, NULL, 0);
+// Built in cat command, the kernel moves the data (see copy.c) instead
+// of a forked /bin/cat copying it through user space
+void cat(Cmd command) {
+  struct stat in, out;
+  char *name;
+  int i, fd, out_ok;
+
+  // Options are left to the real cat
+  for(i = 1; i < command -> nargs; i++) {
+    if(command -> args[i][0] == '-' && command -> args[i][1] != '\0') {
+      run_program(command);
+      return;
+    }
+  }
+
+  // Whatever was printed before goes first
+  fflush(stdout);
+  out_ok = fstat(STDOUT_FILENO, &out) == 0;
+  for(i = 1; i < command -> nargs || i == 1; i++) {
+    name = i < command -> nargs ? command -> args[i] : "-";
+    if(!strcmp(name, "-")) {
+      fd = STDIN_FILENO;
+    } else {
+      fd = open(name, O_RDONLY | O_CLOEXEC);
+      if(fd < 0) {
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+        last_status = 1;
+        continue;
+      }
+    }
+    // A file appended to itself would be copied for ever
+    if(out_ok && S_ISREG(out.st_mode) && fstat(fd, &in) == 0 &&
+       in.st_dev == out.st_dev && in.st_ino == out.st_ino &&
+       (out.st_size > 0 || (fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND))) {
+      fprintf(stderr, "cat: %s: input file is output file\n", name);
+      last_status = 1;
+    } else if(copy_fd(fd, STDOUT_FILENO) < 0) {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      last_status = 1;
+    }
+    if(fd != STDIN_FILENO)
+      close(fd);
   }
 }
 
-// Execute a single command
-void execute_command(Cmd command) {
-  // _old stores the stdin, stdout and stderr before starting execution
-  int stdout_old, stderr_old, stdin_old;
+// Built in true and false commands
+void true_command(Cmd command) {
+}
+
+void false_command(Cmd command) {
+  last_status = 1;
+}
+
+// Built in test ([), printf, basename and dirname commands, see utils.c
+void test_command(Cmd command) {
+  last_status = util_test(command -> nargs, command -> args);
+}
+
+void printf_command(Cmd command) {
+  last_status = util_printf(command -> nargs, command -> args);
+}
+
+void basename_command(Cmd command) {
+  last_status = util_basename(command -> nargs, command -> args);
+}
+
+void dirname_command(Cmd command) {
+  last_status = util_dirname(command -> nargs, command -> args);
+}
 
-  // If the command reads from the file or writes to a file
-  // the folllowing are the fids for those
-  int outfile = -1, infile = -1;
+/*
+ * Built in parallel command
+ * parallel [-j N] cmd [arg...] [::: item...]
+ * Runs cmd for each item, N at a time (the number of CPUs by default).
+ * Items are the words after ::: or else the lines of stdin, {} in the
+ * arguments is replaced by the item.  cmd is looked up once.
+ */
+void parallel_command(Cmd command) {
+  char **args = command -> args + 1;
+  int nargs = command -> nargs - 1;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  char *executable_file_name;
+  int ntemplate;
+
+  if(nargs > 0 && !strncmp(args[0], "-j", 2)) {
+    if(args[0][2] != '\0') {
+      jobs = atoi(args[0] + 2);
+      args++;
+      nargs--;
+    } else if(nargs > 1) {
+      jobs = atoi(args[1]);
+      args += 2;
+      nargs -= 2;
+    }
+  }
+  if(nargs == 0 || jobs < 1) {
+    fprintf(stderr, "usage: parallel [-j N] cmd [arg...] [::: item...]\n");
+    last_status = 2;
+    return;
+  }
 
-  // Dup the current stdout
-  // stdout_old and stderr_old will keep track of stdout and stderr which can be restored later
-  stdout_old = dup(fileno(stdout));
-  stderr_old = dup(fileno(stderr));
-  stdin_old = dup(fileno(stdin));
+  for(ntemplate = 0; ntemplate < nargs; ntemplate++)
+    if(!strcmp(args[ntemplate], ":::"))
+      break;
+
+  executable_file_name = resolve_command(args[0]);
+  if(executable_file_name == NULL) {
+    report_launch_error(args[0], ENOENT);
+    return;
+  }
+  if(ntemplate < nargs)
+    last_status = parallel_run(executable_file_name, args, ntemplate,
+                               args + ntemplate + 1, nargs - ntemplate - 1, jobs);
+  else
+    last_status = parallel_run(executable_file_name, args, ntemplate, NULL, 0, jobs);
+  free(executable_file_name);
+}
+
+/*
+ * Built in concurrently command
+ * concurrently [-j N] "cmdline" "cmdline"...
+ * Starts every command line at once, at most N at a time if -j is given,
+ * and waits for all of them.  Each can be a pipeline or a list.  The
+ * status is that of the first command line that failed.
+ */
+void concurrently_command(Cmd command) {
+  char **args = command -> args + 1;
+  int nargs = command -> nargs - 1;
+  int jobs = 0;
+
+  if(nargs > 0 && !strncmp(args[0], "-j", 2)) {
+    if(args[0][2] != '\0') {
+      jobs = atoi(args[0] + 2);
+      args++;
+      nargs--;
+    } else if(nargs > 1) {
+      jobs = atoi(args[1]);
+      args += 2;
+      nargs -= 2;
+    }
+  }
+  if(nargs == 0) {
+    fprintf(stderr, "usage: concurrently [-j N] cmdline...\n");
+    last_status = 2;
+    return;
+  }
+  last_status = concurrently_run(args, nargs, jobs);
+}
+
+// Built in time command on its own, nothing ran so nothing is used
+// time in front of a pipe is handled by run_pipe()
+void time_command(Cmd command) {
+  struct rusage usage;
+
+  memset(&usage, 0, sizeof(usage));
+  rusage_print("", 0, &usage);
+}
+
+// Built in timeout command, only run when the words after it are not a
+// deadline and a command, see run_pipe()
+void timeout_command(Cmd command) {
+  fprintf(stderr, "usage: timeout [-s signal] [-k grace] duration cmd [| cmd...]\n");
+  last_status = 125;
+}
+
+// Built in help command, lists the built in commands
+void help(Cmd command);
+
+// The built in commands, sorted by name for find_built_in()
+const struct built_in built_ins[] = {
+  {"[",        test_command,      BI_PARENT | BI_PIPELINE,
+   "[ expr ]                same as test"},
+  {"basename", basename_command,  BI_PARENT | BI_PIPELINE,
+   "basename name [suffix]  print name without its directory and suffix"},
+  {"bg",       background_job,    BI_PARENT,
+   "bg [%n]                 continue a stopped job in the background"},
+  {"cat",      cat,               BI_PIPELINE | BI_FILES,
+   "cat [file...]           copy the files to standard output"},
+  {"cd",       change_dir,        BI_PARENT,
+   "cd [dir]                change the current directory"},
+  {"concurrently", concurrently_command, BI_PARENT | BI_PIPELINE | BI_LONG,
+   "concurrently [-j N] cmdline...  run the command lines at once and wait for all"},
+  {"dirname",  dirname_command,   BI_PARENT | BI_PIPELINE,
+   "dirname name...         print the directory part of each name"},
+  {"echo",     echo,              BI_PARENT | BI_PIPELINE,
+   "echo [word...]          print the words"},
+  {"false",    false_command,     BI_PARENT | BI_PIPELINE,
+   "false                   do nothing, unsuccessfully"},
+  {"fg",       foreground_job,    BI_PARENT,
+   "fg [%n]                 continue a job in the foreground"},
+  {"hash",     hash_commands,     BI_PARENT | BI_PIPELINE,
+   "hash [-r] [name...]     list, forget or look up remembered commands"},
+  {"help",     help,              BI_PARENT | BI_PIPELINE,
+   "help                    list the built in commands"},
+  {"jobs",     list_jobs,         BI_PARENT | BI_PIPELINE,
+   "jobs [-l]               list the background jobs"},
+  {"logout",   logout,            BI_PARENT,
+   "logout                  exit the shell"},
+  {"nice",     be_nice,           BI_PARENT | BI_PIPELINE | BI_FORK,
+   "nice [priority] [cmd]   run cmd (or the shell) with another priority"},
+  {"parallel", parallel_command,  BI_PARENT | BI_PIPELINE | BI_LONG,
+   "parallel [-j N] cmd [arg...] [::: item...]  run cmd for each item, N at a time"},
+  {"printf",   printf_command,    BI_PARENT | BI_PIPELINE,
+   "printf format [arg...]  print the arguments as the format says"},
+  {"pwd",      pwd,               BI_PARENT | BI_PIPELINE,
+   "pwd                     print the current directory"},
+  {"rehash",   rehash,            BI_PARENT,
+   "rehash                  forget the remembered commands"},
+  {"setenv",   set_environment,   BI_PARENT | BI_PIPELINE,
+   "setenv [name [value]]   set or list environment variables"},
+  {"test",     test_command,      BI_PARENT | BI_PIPELINE,
+   "test expr               check files and compare strings and numbers"},
+  {"time",     time_command,      BI_PARENT,
+   "time cmd [| cmd...]     run the pipe and report the time and resources used"},
+  {"timeout",  timeout_command,   BI_PARENT,
+   "timeout [-s sig] [-k grace] t cmd [| cmd...]  signal the pipe after t (s, m, h, d)"},
+  {"true",     true_command,      BI_PARENT | BI_PIPELINE,
+   "true                    do nothing, successfully"},
+  {"unsetenv", unset_environment, BI_PARENT,
+   "unsetenv name           remove an environment variable"},
+  {"wait",     wait_jobs,         BI_PARENT,
+   "wait [%n|pid...]        wait for background jobs"},
+  {"where",    find_where,        BI_PARENT | BI_PIPELINE,
+   "where name              show where a command comes from"},
+};
+
+#define NUM_BUILT_INS (sizeof(built_ins) / sizeof(built_ins[0]))
+
+int compare_built_in(const void *name, const void *entry) {
+  return strcmp((const char *)name, ((const struct built_in *)entry) -> name);
+}
+
+// Looks up a built in command, NULL if there is no such built in
+const struct built_in *find_built_in(const char *command_name) {
+  return bsearch(command_name, built_ins, NUM_BUILT_INS, sizeof(struct built_in), compare_built_in);
+}
+
+void help(Cmd command) {
+  int i;
+
+  for(i = 0; i < NUM_BUILT_INS; i++)
+    printf("%s\n", built_ins[i].help);
+}
+
+// Runs a built in command, its exit status is 0 unless it says otherwise
+void run_built_in(const struct built_in *built_in, Cmd command) {
+  last_status = 0;
+  built_in -> handler(command);
+}
+
+// Where the stdin, stdout and stderr of a command go, worked out once
+// from the Cmd before it runs.  fds[i] is the descriptor that becomes
+// descriptor i, -1 leaves it alone.  infile and outfile are the files
+// opened for the plan, the shell closes them once the command started.
+struct redirect_plan {
+  int fds[3];
+  int infile, outfile;
+};
+
+// Plans the redirections of a command.  in and out are the pipe ends of
+// a pipeline stage, -1 if there are none.  Files are opened close-on-exec,
+// nothing else is done in the shell.
+// Returns -1 if a file could not be opened
+int plan_redirection(Cmd command, int in, int out, struct redirect_plan *plan) {
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+
+  plan -> fds[0] = in;
+  plan -> fds[1] = out;
+  plan -> fds[2] = -1;
+  plan -> infile = plan -> outfile = -1;
 
   if(command -> in == Tin) {
     // Open a file for reading
-    infile = open(command -> infile, O_RDONLY);
-    // standard in should read from the file now
-    dup2(infile, STDIN_FILENO);
+    plan -> infile = open(command -> infile, O_RDONLY | O_CLOEXEC);
+    if(plan -> infile < 0) {
+      perror(command -> infile);
+      return -1;
+    }
+    plan -> fds[0] = plan -> infile;
   }
 
   // Handle output redirection
   switch(command -> out) {
     case Tout:
-      outfile = open(command -> outfile, O_WRONLY | O_CREAT | O_TRUNC,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-      // file descriptor # 1 should now point to the above file
-      dup2(outfile, STDOUT_FILENO);
-      break;
-    case Tapp:
-      outfile = open(command -> outfile, O_WRONLY | O_APPEND | O_CREAT,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-      dup2(outfile, STDOUT_FILENO);
-      break;
     case ToutErr:
-      outfile = open(command -> outfile, O_WRONLY | O_CREAT | O_TRUNC,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-      // Both standard error and standard out should point to the file
-      dup2(outfile, STDOUT_FILENO);
-      dup2(outfile, STDERR_FILENO);
+      flags |= O_TRUNC;
       break;
+    case Tapp:
     case TappErr:
-      outfile = open(command -> outfile, O_WRONLY | O_APPEND | O_CREAT,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-      dup2(outfile, STDOUT_FILENO);
-      dup2(outfile, STDERR_FILENO);
+      flags |= O_APPEND;
       break;
+    case TpipeErr:
+      // Also connect error to the pipe
+      plan -> fds[2] = out;
+      return 0;
+    default:
+      return 0;
+  }
+
+  plan -> outfile = open(command -> outfile, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if(plan -> outfile < 0) {
+    perror(command -> outfile);
+    if(plan -> infile != -1)
+      close(plan -> infile);
+    return -1;
+  }
+  plan -> fds[1] = plan -> outfile;
+  // Both standard error and standard out should point to the file
+  if(command -> out == ToutErr || command -> out == TappErr)
+    plan -> fds[2] = plan -> outfile;
+  return 0;
+}
+
+// Closes the files opened for a plan
+void close_plan(struct redirect_plan *plan) {
+  if(plan -> infile != -1)
+    close(plan -> infile);
+  if(plan -> outfile != -1)
+    close(plan -> outfile);
+}
+
+// Applies a plan to the shell itself, for a built in command
+// The descriptors that change are saved in saved[] first
+void apply_plan(struct redirect_plan *plan, int saved[3]) {
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    saved[i] = -1;
+    if(plan -> fds[i] < 0 || plan -> fds[i] == i)
+      continue;
+    fflush(i == STDOUT_FILENO ? stdout : stderr);
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    dup2(plan -> fds[i], i);
+  }
+}
+
+// Puts back what apply_plan() saved
+void restore_plan(int saved[3]) {
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    if(saved[i] < 0)
+      continue;
+    // What the built in printed goes to the file, not where we return to
+    fflush(i == STDOUT_FILENO ? stdout : stderr);
+    dup2(saved[i], i);
+    close(saved[i]);
   }
+}
 
+// Execute a single command
+// External commands get their redirections in the child, only built in
+// commands that redirect make the shell move its own descriptors around
+void execute_command(Cmd command) {
+  struct redirect_plan plan;
+  int saved[3];
+  const struct built_in *built_in;
+  int error;
+
+  trace_begin("redirect", command -> args[0]);
+  error = plan_redirection(command, -1, -1, &plan);
+  trace_end("redirect", TRACE_NONE, TRACE_NONE);
+  if(error < 0) {
+    last_status = 1;
+    return;
+  }
 
   // Get the command name, it is the first argument
-  char *command_name = command -> args[0];
-  if(!strcmp(command_name, "echo")) {
-    echo(command);
-  } else if(!strcmp(command_name, "cd")) {
-    change_dir(command);
-  } else if(!strcmp(command_name, "pwd")) {
-    pwd();
-  } else if(!strcmp(command_name, "logout")) {
-    logout();
-  } else if(!strcmp(command_name, "setenv")) {
-    set_environment(command);
-  } else if(!strcmp(command_name, "unsetenv")) {
-    unset_environment(command);
-  } else if(!strcmp(command_name, "where")) {
-    find_where(command);
-  } else if(!strcmp(command_name, "nice")){
-    be_nice(command);
+  built_in = find_built_in(command -> args[0]);
+  if(built_in != NULL) {
+    trace_begin("redirect", command -> args[0]);
+    apply_plan(&plan, saved);
+    trace_end("redirect", TRACE_NONE, TRACE_NONE);
+    run_built_in(built_in, command);
+    restore_plan(saved);
   } else {
     // This is not a built in command
     // Execute non-built in command
-    execute_non_built_in_command(command);
+    execute_non_built_in_command(command, plan.fds);
   }
 
   // We are done with the command
   // If any infile or outfiles were open close them
-  if(outfile != -1) {
-    close(outfile);
-  }
-  if(infile != -1)
-    close(infile);
-
-  if(command -> in == Tin) {
-    // Restore the system in and return the descriptor
-    dup2(stdin_old, STDIN_FILENO);
-    close(stdin_old);
-  }
+  close_plan(&plan);
+}
 
-  // Restore the stdout stdin and return the descriptor to the pool
-  dup2(stdout_old, STDOUT_FILENO);
-  dup2(stderr_old, STDERR_FILENO);
-  dup2(stdin_old, STDIN_FILENO);
-  close(stdout_old);
-  close(stderr_old);
-  close(stdin_old);
+// A built in command that runs as a pipeline stage
+struct built_in_stage {
+  const struct built_in *built_in;
+  Cmd command;
+};
+
+// Runs a built in command as a pipeline stage, in the child
+int run_built_in_stage(void *arg) {
+  struct built_in_stage *stage = arg;
+
+  trace_child();
+  jobs_child();
+  in_stage = 1;
+  run_built_in(stage -> built_in, stage -> command);
+  fflush(NULL);
+  return last_status;
 }
 
-void execute_pipe_command(int in, int out, Cmd command) {
+// Starts one stage of a pipeline and returns the pid of the child without
+// waiting for it.  in and out are the descriptors the stage reads from and
+// writes to (-1 for the shell's own) and pgid is the process group of the
+// pipeline, 0 for the
+// first stage.  A foreground pipeline gets the terminal.
+// Returns -1 if the stage could not be started.
+pid_t execute_pipe_command(int in, int out, pid_t pgid, int foreground, Cmd command) {
   char *absolute_path = NULL;
-  int pid;
+  pid_t pid;
   char *command_name = command -> args[0];
-  int stdout_old, stderr_old;
-  int outfile = 0;
-  char **command_args;
-  int priority;
+  struct redirect_plan plan;
+  char **command_args = command -> args;
+  int priority = 0;
+  int error;
+  struct spawn_attr attr;
+  struct built_in_stage stage;
+  const struct built_in *built_in = find_built_in(command_name);
+
+  spawn_attr_init(&attr);
+
+  // nice runs its command as the stage, with the priority set in the child
+  if(built_in != NULL && (built_in -> flags & BI_FORK)) {
+    command_args = command -> nargs > 1 ? nice_arguments(command, &priority) : NULL;
+    if(command_args == NULL) {
+      fprintf(stderr, "%s: no command to run in a pipeline\n", command_name);
+      return -1;
+    }
+    command_name = command_args[0];
+    built_in = NULL;
+  }
 
-  if(out == 1) {
-    // Should we print it to out or somewhere else
-    if(command -> out == Tapp) {
-      outfile = open(command -> outfile, O_WRONLY | O_APPEND | O_CREAT,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-    } else if (command -> out == Tout) {
-      outfile = open(command -> outfile, O_WRONLY | O_CREAT | O_TRUNC,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if(built_in != NULL) {
+    // Built in commands in a pipeline run in the child like any other
+    // stage, the child gets a copy of stage
+    stage.built_in = built_in;
+    stage.command = command;
+    attr.function = run_built_in_stage;
+    attr.arg = &stage;
+  } else {
+    absolute_path = resolve_command(command_name);
+    if(absolute_path == NULL) {
+      report_launch_error(command_name, ENOENT);
+      return -1;
     }
   }
 
-  // If this is a built in command, we need to handle the built in command
-  if(is_built_in_command(command_name)) {
+  // The first command may read from a file, the last one write to one
+  if(plan_redirection(command, in, out, &plan) < 0) {
+    free(absolute_path);
+    return -1;
+  }
+
+  attr.path = absolute_path;
+  attr.argv = command_args;
+  attr.envp = env_envp();
+  attr.pgid = pgid;
+  attr.foreground = foreground && interactive && pgid == 0;
+  attr.priority = priority;
+  memcpy(attr.fds, plan.fds, sizeof(attr.fds));
+
+  pid = spawn_process(&attr, &error);
+  if(pid < 0)
+    report_launch_error(command_name, error);
+
+  free(absolute_path);
+  close_plan(&plan);
+  return pid;
+}
+
+// Starts a pipeline, with background set it is not waited for
+void setup_pipeline(Pipe p, int background) {
+  // Copy the command pointers in an array
+  Cmd *cmd_array = NULL;
+  int num_commands = 0;
+  Cmd current;
+  int i;
+  int in = -1, out, next_in;
+  int fd[2];
+  pid_t pid;
+  char text[1024];
+  Job job;
+
+  num_commands = getCommandCount(p);
+  cmd_array = (Cmd *)malloc(num_commands * sizeof(Cmd));
+  text[0] = '\0';
+  for(i = 0, current = p -> head; i < num_commands && current != NULL; i++, current = current -> next) {
+    cmd_array[i] = current;
+    if(i > 0)
+      strncat(text, current -> in == TpipeErr ? " |& " : " | ", sizeof(text) - strlen(text) - 1);
+    command_text(current, text, sizeof(text));
+  }
+  if(background)
+    strncat(text, " &", sizeof(text) - strlen(text) - 1);
+
+  if(background && !interactive) {
+    // Without job control nobody could tell which job the input is for
+    in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
 
-    // back up the current file descriptors for out and err
-    stdout_old = dup(fileno(stdout));
-    stderr_old = dup(fileno(stderr));
-    // Create two new descriptors
-    if(outfile == 0) {
-      dup2(out, STDOUT_FILENO);
-      dup2(out, STDERR_FILENO);
+  job = job_create(text);
+  job -> timed = timing;
+
+  // Start every stage before waiting for any of them, otherwise a stage
+  // writing more than a pipe buffer would block forever
+  for(i = 0; i < num_commands; i++) {
+    if(i < num_commands - 1) {
+      // Create a pipe, close-on-exec so no other stage inherits it
+      pipe2(fd, O_CLOEXEC);
+      out = fd[1];
+      next_in = fd[0];
     } else {
-      dup2(outfile, STDOUT_FILENO);
-      dup2(outfile, STDERR_FILENO);
-    }
-    if(!strcmp(command_name, "echo")) {
-      echo(command);
-    } else if(!strcmp(command_name, "cd")) {
-      change_dir(command);
-    } else if(!strcmp(command_name, "pwd")) {
-      pwd();
-    } else if(!strcmp(command_name, "logout")) {
-      logout();
-    } else if(!strcmp(command_name, "setenv")) {
-      set_environment(command);
-    } else if(!strcmp(command_name, "unsetenv")) {
-      unset_environment(command);
-    } else if(!strcmp(command_name, "where")) {
-      find_where(command);
+      // Last command outputs to std out
+      out = -1;
+      next_in = -1;
     }
-    dup2(stdout_old, STDOUT_FILENO);
-    dup2(stderr_old, STDERR_FILENO);
-    close(stdout_old);
-    close(stderr_old);
-    return;
+
+    pid = execute_pipe_command(in, out, job -> pgid, !background, cmd_array[i]);
+    job_add_process(job, pid, cmd_array[i] -> args[0]);
+
+    // The parent keeps none of the pipe ends
+    if(in != -1)
+      close(in);
+    if(out != -1)
+      close(out);
+    in = next_in;
   }
+  job_timeout(job, &deadline);
 
-  // Special habndling of nice command
-  if(!strcmp(command_name, "nice")) {
-    if(command -> nargs == 1) {
-      setpriority(PRIO_PROCESS, 0, 4);
-      return;
-    }
-    else {
-      priority = atoi(command -> args[1]);
-      if(priority < -20) priority = -20;
-      if(priority > 19) priority = 19;
-      if(priority == 0) {
-        setpriority(PRIO_PROCESS, 0, 4);
-        // command name is the second argument
-        command_name = command -> args[1];
-        command_args = command -> args + 1;
-      } else {
-        setpriority(PRIO_PROCESS, 0, priority);
-        command_name = command -> args[2];
-        command_args = command -> args + 2;
-      }
-    }
+  if(background && job -> npids > 0) {
+    job_background(job);
+    last_status = 0;
   } else {
-    command_args = command -> args;
+    // All stages share the job's process group, they are reaped in
+    // whatever order they finish
+    last_status = job_wait(job);
   }
 
+  free(cmd_array);
+}
+
+// Runs a built in command prefixed with time
+// It runs in the shell, so what it used is the shell's own usage
+void time_built_in(Cmd command) {
+  struct timespec start, end;
+  struct rusage before, after;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  getrusage(RUSAGE_SELF, &before);
+  execute_command(command);
+  getrusage(RUSAGE_SELF, &after);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+  timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+  after.ru_majflt -= before.ru_majflt;
+  after.ru_minflt -= before.ru_minflt;
+  after.ru_nvcsw -= before.ru_nvcsw;
+  after.ru_nivcsw -= before.ru_nivcsw;
+  rusage_print("", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, &after);
+}
 
-  // This is not a built in pipe command
-  // Figure out the absolute path of this command
-  if(command_name[0] == '/') {
-    // This is a path to an executable file
-    if(access(command_name, X_OK) == 0) {
-      absolute_path = command_name;
-    }
-  } else if(strchr(command_name, '/') != NULL) {
-    if(file_exists(current_dir, command_name) == 0) {
-      absolute_path = (char *)malloc((strlen(current_dir) + strlen(command_name) + 1) * sizeof(char));
-      strcpy(absolute_path, current_dir);
-      strcat(absolute_path, "/");
-      strcat(absolute_path, command_name);
-    }
-  }
+// Tells if a file is a regular one.  fd is used if name is NULL, a name
+// that does not exist yet will be a regular file once it is created
+int regular_file(const char *name, int fd) {
+  struct stat sb;
 
-  // This is neither the absolute or relative file path to an executable
-  if(absolute_path == NULL)
-    absolute_path = locate_in_path(command_name);
+  if(name == NULL)
+    return fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode);
+  if(stat(name, &sb) < 0)
+    return errno == ENOENT;
+  return S_ISREG(sb.st_mode);
+}
 
-  if(absolute_path == NULL) {
-    fprintf(stderr, "command not found\n");
-    return;
+// Tells if a command reads only regular files and writes a regular file,
+// a file that cannot be opened is reported by the command itself
+int copies_files(Cmd command) {
+  const char *output = NULL;
+  int i, from_stdin = command -> nargs == 1;
+
+  for(i = 1; i < command -> nargs; i++) {
+    if(!strcmp(command -> args[i], "-"))
+      from_stdin = 1;
+    else if(!regular_file(command -> args[i], -1))
+      return 0;
   }
+  if(from_stdin && !regular_file(command -> in == Tin ? command -> infile : NULL, STDIN_FILENO))
+    return 0;
+  if(command -> out == Tout || command -> out == Tapp ||
+     command -> out == ToutErr || command -> out == TappErr)
+    output = command -> outfile;
+  return regular_file(output, STDOUT_FILENO);
+}
+
+/*
+ * Tells if a built in command has to run as a pipeline stage, forked,
+ * instead of in the shell: one that may not run in the shell, one with a
+ * deadline, which could not be signalled in the shell, and one that may
+ * block the shell (BI_FILES, BI_LONG when interactive)
+ */
+int runs_as_stage(const struct built_in *built_in, Cmd command) {
+  if(built_in == NULL || !(built_in -> flags & BI_PIPELINE) || (built_in -> flags & BI_FORK))
+    return 0;
+  if(deadline.seconds > 0)
+    return 1;
+  if(built_in -> flags & BI_FILES)
+    return !copies_files(command);
+  if((built_in -> flags & BI_LONG) && interactive)
+    return 1;
+  return !(built_in -> flags & BI_PARENT);
+}
 
+// Drops the first n words of a command, taken by the time or timeout in
+// front of it
+void shift_words(Cmd command, int n) {
+  command -> args += n;
+  command -> nargs -= n;
+  if(command -> globs != NULL)
+    command -> globs += n;
+}
 
+// Reads a duration, a number of seconds or of minutes, hours or days with
+// m, h or d after it.  Returns -1 if it is none
+int parse_duration(const char *text, double *seconds) {
+  char *end;
+  double n = strtod(text, &end);
+
+  if(end == text || !(n >= 0) || (*end != '\0' && end[1] != '\0'))
+    return -1;
+  switch(*end) {
+  case '\0':
+  case 's':
+    break;
+  case 'm':
+    n *= 60;
+    break;
+  case 'h':
+    n *= 60 * 60;
+    break;
+  case 'd':
+    n *= 24 * 60 * 60;
+    break;
+  default:
+    return -1;
+  }
+  // Forever, as far as a timer goes
+  if(n > 1e9)
+    n = 1e9;
+  *seconds = n;
+  return 0;
+}
 
-  // We found an executable that we can execute
-  // Fork a process
-  pid = fork();
+// A signal by number or by name, with or without SIG, -1 if it is none
+int signal_number(const char *name) {
+  const char *abbrev;
+  int i;
 
-  if(pid == 0) {
-    if(in != 0) {
-      dup2(in, STDIN_FILENO);
-      close(in);
-    }
+  if(name[0] >= '0' && name[0] <= '9') {
+    i = atoi(name);
+    return i > 0 && i < NSIG ? i : -1;
+  }
+  if(!strncasecmp(name, "SIG", 3))
+    name += 3;
+  for(i = 1; i < NSIG; i++) {
+    abbrev = sigabbrev_np(i);
+    if(abbrev != NULL && !strcasecmp(abbrev, name))
+      return i;
+  }
+  return -1;
+}
 
-    if(out != 1) {
-      dup2(out, STDOUT_FILENO);
-      // Also connect error if needed
-      if(command -> out == TpipeErr)
-        dup2(out, STDERR_FILENO);
-      close(out);
+/*
+ * Reads what timeout puts in front of a pipe:
+ *   timeout [-s signal] [-k grace] duration cmd...
+ * Returns the number of words up to the command, or 0 if they are wrong
+ * or no command follows, the timeout builtin then tells how it is used.
+ */
+int timeout_prefix(Cmd command, struct timeout *timeout) {
+  char **args = command -> args;
+  int n = 1;
+
+  timeout -> seconds = 0;
+  timeout -> signal = SIGTERM;
+  timeout -> grace = 0;
+  while(n + 1 < command -> nargs && args[n][0] == '-') {
+    if(!strcmp(args[n], "-s")) {
+      timeout -> signal = signal_number(args[n + 1]);
+      if(timeout -> signal < 0)
+        return 0;
+    } else if(!strcmp(args[n], "-k")) {
+      if(parse_duration(args[n + 1], &timeout -> grace) < 0)
+        return 0;
     } else {
-      // This is the last command
-      if(outfile != 0) {
-        dup2(outfile, STDOUT_FILENO);
-        close(outfile);
-      }
+      break;
     }
-
-    // Child will do this
-    execve(absolute_path, command_args, environ);
-    exit(0);
-  } else {
-    // Parent just waits for the child
-    waitpid(pid, NULL, 0);
+    n += 2;
   }
+  if(n + 1 >= command -> nargs || parse_duration(args[n], &timeout -> seconds) < 0) {
+    timeout -> seconds = 0;
+    return 0;
+  }
+  return n + 1;
 }
 
-void setup_pipeline(Pipe p) {
-  // Copy the command pointers in an array
-  Cmd *cmd_array = NULL;
-  int num_commands = 0;
-  Cmd current;
-  int i;
-  int in = 0;
-  int fd[2];
-  char *absolute_path;
-  int pid;
-  // Last command outputs to std out
-  int last_command_out = 1;
+// The args that came from one glob pattern
+struct expansion {
+  int start, count;
+};
 
+/*
+ * Replaces the glob patterns among the args of a command by the paths
+ * they match, see glob.c
+ * A pattern that matches nothing stays as it is.  *widest tells which
+ * args came from the pattern with the most matches.
+ */
+void expand_globs(Cmd command, struct expansion *widest) {
+  struct glob_list *lists;
+  char **args, *p;
+  int i, j, n, nargs;
+  size_t size = 0;
+
+  widest -> start = widest -> count = 0;
+  if(command -> globs == NULL)
+    return;
 
-  num_commands = getCommandCount(p);
-  cmd_array = (Cmd *)malloc(num_commands * sizeof(Cmd));
-  for(i = 0, current = p -> head; i < num_commands && current != NULL; i++, current = current -> next) {
-    cmd_array[i] = current;
+  lists = calloc(command -> nargs, sizeof(struct glob_list));
+  nargs = 0;
+  for(i = 0; i < command -> nargs; i++) {
+    n = 1;
+    if(command -> globs[i] != NULL && glob_has_magic(command -> globs[i])) {
+      trace_begin("glob", command -> globs[i]);
+      n = glob_expand(command -> globs[i], &lists[i]);
+      trace_end("glob", TRACE_NONE, n);
+      for(j = 0; j < n; j++)
+        size += strlen(lists[i].paths[j]) + 1;
+      n = n > 0 ? n : 1;
+    }
+    nargs += n;
   }
 
-  // First command may read from a file
-  // We need to check that
-  if(cmd_array[0] -> in == Tin) {
-    // open the file in read mode
-    in = open(cmd_array[0] -> infile, O_RDONLY);
+  // The paths go to the arena with the rest of the command
+  args = parseAlloc((nargs + 1) * sizeof(char *));
+  p = parseAlloc(size);
+  nargs = 0;
+  for(i = 0; i < command -> nargs; i++) {
+    if(lists[i].count == 0) {
+      args[nargs++] = command -> args[i];
+      continue;
+    }
+    if(lists[i].count > widest -> count) {
+      widest -> start = nargs;
+      widest -> count = lists[i].count;
+    }
+    for(j = 0; j < lists[i].count; j++) {
+      args[nargs++] = strcpy(p, lists[i].paths[j]);
+      p += strlen(p) + 1;
+    }
+    glob_free(&lists[i]);
   }
+  args[nargs] = NULL;
+  free(lists);
 
+  command -> args = args;
+  command -> nargs = nargs;
+  command -> maxargs = nargs + 1;
+  command -> globs = NULL;
+}
 
-  // print the commands
-  for(i = 0; i < num_commands - 1; i++) {
+// Returns how much of the space for execve's arguments args take
+long args_size(char **args, int nargs) {
+  long size = 0;
+  int i;
 
-    // Create a pipe
-    pipe(fd);
+  for(i = 0; i < nargs; i++)
+    size += strlen(args[i]) + 1 + sizeof(char *);
+  return size;
+}
 
-    execute_pipe_command(in, fd[1], cmd_array[i]);
+// Returns how much space execve leaves for the arguments
+long args_limit() {
+  char **envp = env_envp();
+  int n;
 
-    // Closing the write end of the pipe
-    close(fd[1]);
+  for(n = 0; envp[n] != NULL; n++)
+    ;
+  // Some room is kept, like xargs does
+  return sysconf(_SC_ARG_MAX) - args_size(envp, n) - 2048;
+}
 
-    // First command may read from a file
-    in = fd[0];
+/*
+ * Runs an external command whose args are too long for one execve as
+ * often as it takes, like xargs
+ * The args from the widest expansion are shared out between the runs,
+ * every run gets all the others.  Later runs append to the file the
+ * first one wrote.  The status is that of the last run that failed.
+ */
+void run_in_batches(Cmd command, struct expansion *widest) {
+  char **all = command -> args;
+  int nall = command -> nargs;
+  int end = widest -> start + widest -> count;
+  Token out = command -> out;
+  char **args;
+  long limit, size, arg_size;
+  int next, n, status = 0;
+
+  limit = args_limit() - args_size(all, widest -> start) - args_size(all + end, nall - end);
+  args = malloc((nall + 1) * sizeof(char *));
+  memcpy(args, all, widest -> start * sizeof(char *));
+  for(next = widest -> start; next < end; ) {
+    n = widest -> start;
+    size = 0;
+    while(next < end) {
+      arg_size = strlen(all[next]) + 1 + sizeof(char *);
+      if(size + arg_size > limit && n > widest -> start)
+        break;
+      size += arg_size;
+      args[n++] = all[next++];
+    }
+    memcpy(args + n, all + end, (nall - end) * sizeof(char *));
+    n += nall - end;
+    args[n] = NULL;
+
+    command -> args = args;
+    command -> nargs = n;
+    execute_command(command);
+    if(last_status != 0)
+      status = last_status;
+    // Stop if it was killed, by ^C say
+    if(last_status > 128)
+      break;
+    if(command -> out == Tout)
+      command -> out = Tapp;
+    else if(command -> out == ToutErr)
+      command -> out = TappErr;
   }
 
-  execute_pipe_command(in, 1, cmd_array[i]);
+  command -> args = all;
+  command -> nargs = nall;
+  command -> out = out;
+  free(args);
+  last_status = status;
 }
 
-// Executes the pipe
-void executePipe(Pipe p) {
+// Tells if a command has to be run in batches, see run_in_batches()
+int needs_batches(Cmd command, struct expansion *widest) {
+  return widest -> count > 0 && find_built_in(command -> args[0]) == NULL &&
+         args_size(command -> args, command -> nargs) > args_limit();
+}
+
+// Executes one pipe of a pipe list
+void run_pipe(Pipe p) {
   int num_command = 0;
-  if(p == NULL)
-    return;
+  const struct built_in *built_in;
+  struct expansion widest;
+  int timed, staged, n;
+  Cmd last, c;
   // Count the number of commands in the pipe
   // If there is just one command, we only need to run that
   // otherwise we will need to setup pipeline
@@ -747,13 +1531,96 @@ void executePipe(Pipe p) {
   if(num_command == 0)
     return;
 
-  if(num_command == 1) {
-    execute_command(p -> head);
+  // A pipe ending in & runs in the background
+  for(last = p -> head; last -> next != NULL; last = last -> next)
+    ;
+
+  // time in front of the pipe times all of it
+  timed = p -> head -> nargs > 1 && !strcmp(p -> head -> args[0], "time");
+  if(timed)
+    shift_words(p -> head, 1);
+
+  // timeout in front of it gives all of it a deadline
+  deadline.seconds = 0;
+  if(!strcmp(p -> head -> args[0], "timeout") &&
+     (n = timeout_prefix(p -> head, &deadline)) > 0)
+    shift_words(p -> head, n);
+
+  for(c = p -> head; c != NULL; c = c -> next)
+    expand_globs(c, &widest);
+
+  built_in = find_built_in(p -> head -> args[0]);
+  staged = num_command == 1 && runs_as_stage(built_in, p -> head);
+
+  if(timed) {
+    if(num_command == 1 && last -> exec != Tamp && !staged &&
+       built_in != NULL && !(built_in -> flags & BI_FORK)) {
+      time_built_in(p -> head);
+      deadline.seconds = 0;
+      return;
+    }
+    timing = 1;
+  }
+
+  if(num_command == 1 && last -> exec != Tamp && !staged) {
+    if(needs_batches(p -> head, &widest))
+      run_in_batches(p -> head, &widest);
+    else
+      execute_command(p -> head);
   } else {
-    setup_pipeline(p);
+    setup_pipeline(p, last -> exec == Tamp);
+  }
+  timing = 0;
+  deadline.seconds = 0;
+}
+
+// Executes the pipe list
+void executePipe(Pipe p) {
+  for(; p != NULL; p = p -> next)
+    run_pipe(p);
+}
+
+// Replaces the shell with an external command, nothing is forked
+// Returns only if the command is a built in, runs in the background or
+// is part of a pipeline
+void exec_command(Pipe p) {
+  Cmd command = p -> head;
+  struct redirect_plan plan;
+  struct expansion widest;
+  char *executable_file_name;
+  sigset_t set;
+  int i;
+
+  if(getCommandCount(p) != 1 || command -> exec == Tamp)
+    return;
+  expand_globs(command, &widest);
+  if(find_built_in(command -> args[0]) != NULL)
+    return;
+  if(needs_batches(command, &widest)) {
+    run_in_batches(command, &widest);
+    exit(last_status);
+  }
+
+  if(plan_redirection(command, -1, -1, &plan) < 0)
+    exit(1);
+  executable_file_name = resolve_command(command -> args[0]);
+  if(executable_file_name == NULL) {
+    report_launch_error(command -> args[0], ENOENT);
+    exit(last_status);
   }
 
-  executePipe(p -> next);
+  fflush(NULL);
+  for(i = 0; i < 3; i++)
+    if(plan.fds[i] >= 0 && plan.fds[i] != i)
+      dup2(plan.fds[i], i);
+  // The command must not inherit the blocked SIGCHLD
+  sigemptyset(&set);
+  sigprocmask(SIG_SETMASK, &set, NULL);
+
+  trace_close();
+  execve(executable_file_name, command -> args, env_envp());
+  report_launch_error(command -> args[0], errno);
+  exit(last_status);
 }
 
 int is_empty_or_end(Pipe p) {
@@ -768,60 +1635,232 @@ int is_empty_or_end(Pipe p) {
 }
 
 
+// Parses the next line, skipping lines with errors
+// Returns NULL at the end of the input
+Pipe next_pipe() {
+  Pipe p;
+
+  if(from_image)
+    return script_next();
+  do {
+    trace_begin("parse", NULL);
+    p = parse();
+    trace_end("parse", TRACE_NONE, TRACE_NONE);
+  } while(p == NULL);
+  if(is_empty_or_end(p))
+    return NULL;
+  script_add(p);
+  return p;
+}
+
+// Runs commands until the end of the input, without prompts
+// With exec_last the last command of the input is exec'd in place of
+// the shell, there is nothing left to do after it
+void run_batch(int exec_last) {
+  Pipe p, next, q;
+
+  p = next_pipe();
+  while(p != NULL) {
+    jobs_notify();
+    if(!exec_last) {
+      executePipe(p);
+      freePipe(p);
+      p = next_pipe();
+      continue;
+    }
+
+    // Parsing one line ahead tells whether this one is the last
+    next = next_pipe();
+    for(q = p; q != NULL; q = q -> next) {
+      if(next == NULL && q -> next == NULL)
+        exec_command(q);
+      run_pipe(q);
+    }
+    freePipe(p);
+    p = next;
+  }
+}
+
+// Runs a script file or the .ushrc, from its compiled image if it has
+// one, see script.c
+void run_script(const char *path, int fd) {
+  int errors = parseErrors();
+
+  setParseInput(fd);
+  trace_begin("script", path);
+  from_image = script_open(path, fd);
+  trace_end("script", TRACE_NONE, from_image);
+  run_batch(0);
+  from_image = 0;
+  script_close(parseErrors() == errors);
+}
+
 void handle_ushrc() {
+  const char *home = home_dir();
   char *ushrc_path;
   int ushrc_fid;
-  int stdin_old = dup(fileno(stdin));
-  Pipe p;
 
-  ushrc_path = (char *)malloc((strlen(homedir) + strlen("/.ushrc") + 1) * sizeof(char));
-  strcpy(ushrc_path, homedir);
+  ushrc_path = (char *)malloc((strlen(home) + strlen("/.ushrc") + 1) * sizeof(char));
+  strcpy(ushrc_path, home);
   strcat(ushrc_path, "/.ushrc");
 
-  if(access(ushrc_path, R_OK) != 0)
-    return;
-
   // File exists .. open it
-  ushrc_fid = open(ushrc_path, O_RDONLY);
-
-  // Redirect input to this file
-  dup2(ushrc_fid, STDIN_FILENO);
-
-  // handle ushrc
-  while(1) {
-    // Parse the pipe
-    p = parse();
-    if(is_empty_or_end(p))
-      break;
-    executePipe(p);
+  ushrc_fid = open(ushrc_path, O_RDONLY | O_CLOEXEC);
+  if(ushrc_fid < 0) {
+    free(ushrc_path);
+    return;
   }
 
+  // Read commands from this file
+  run_script(ushrc_path, ushrc_fid);
+  free(ushrc_path);
+
   // ushrc handling done ... now move everything back
-  dup2(stdin_old, STDIN_FILENO);
+  setParseInput(STDIN_FILENO);
 
   // Close the file descriptors we used in this function
   close(ushrc_fid);
-  close(stdin_old);
+}
+
+// Runs the commands of a client of the command server, in the worker
+// forked for it, which is already in the client's directory
+int run_request(char *commands) {
+  free(current_dir);
+  current_dir = NULL;
+  setParseString(commands);
+  run_batch(0);
+  return last_status;
+}
+
+static void input_ready(void *ready) {
+  *(int *)ready = 1;
+}
+
+// Runs the event loop until a line can be read, so background jobs reach
+// their timeout while the shell waits at the prompt
+void wait_for_input(int fd) {
+  Event input;
+  int ready = 0;
 
+  input = event_fd(fd, input_ready, &ready);
+  if(input == NULL)
+    return;
+  while(!ready)
+    events_run(-1);
+  event_remove(input);
+}
 
+void usage() {
+  fprintf(stderr, "usage: ush [--startup-stats] [-c commands | file | --server sock | --client sock commands]\n");
+  exit(2);
 }
 
+/*
+ * ush [--startup-stats] [-c commands | file | --server sock | --client sock commands]
+ * With -c or a script file the shell runs the commands and exits with the
+ * status of the last one.  Neither reads .ushrc or shows prompts.
+ * --server keeps an initialized shell waiting for --client requests,
+ * see server.c.
+ * --startup-stats prints how long each phase of the start took.
+ */
 int main(int argc, char *argv[])
 {
   Pipe p;
+  char *commands = NULL;
+  char *script = NULL;
+  char *server = NULL;
+  int script_fd;
+
+  clock_gettime(CLOCK_MONOTONIC, &startup_time);
+  phase_time = startup_time;
+  if(argc > 1 && !strcmp(argv[1], "--startup-stats")) {
+    startup_stats = 1;
+    argv++;
+    argc--;
+  }
+
+  if(argc > 1 && !strcmp(argv[1], "-c")) {
+    if(argc < 3)
+      usage();
+    commands = argv[2];
+  } else if(argc > 1 && !strcmp(argv[1], "--client")) {
+    // The client sets nothing up, the server did
+    if(argc != 4)
+      usage();
+    return client_run(argv[2], argv[3]);
+  } else if(argc > 1 && !strcmp(argv[1], "--server")) {
+    if(argc != 3)
+      usage();
+    server = argv[2];
+  } else if(argc > 1) {
+    script = argv[1];
+  }
+
+  // The zygote is forked while the shell is still small.  Not for the
+  // server, whose workers wait for their own children
+  if(getenv("USH_ZYGOTE") != NULL && server == NULL) {
+    zygote_start();
+    startup_phase("zygote");
+  }
 
   // initialize the shell
+  trace_init();
+  startup_phase("trace");
   init();
+  startup_phase("env");
+
+  // When reading from a terminal the shell does job control
+  interactive = commands == NULL && script == NULL && server == NULL &&
+                isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+  jobs_init(interactive);
+  startup_phase("jobs");
+
+  // Output is written when a child is started or the shell exits, not
+  // line by line
+  if(!interactive)
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+
+  if(commands != NULL) {
+    startup_done();
+    setParseString(commands);
+    run_batch(1);
+    exit(last_status);
+  }
+  if(script != NULL) {
+    script_fd = open(script, O_RDONLY | O_CLOEXEC);
+    if(script_fd < 0) {
+      perror(script);
+      exit(127);
+    }
+    startup_done();
+    run_script(script, script_fd);
+    exit(last_status);
+  }
 
   handle_ushrc();
+  startup_phase("ushrc");
+  startup_done();
+
+  if(server != NULL) {
+    setParseInput(-1);
+    exit(server_run(server, run_request));
+  }
+
+  if(interactive)
+    setParseWait(wait_for_input);
 
   while ( 1 ) {
+    // Report background jobs that finished
+    jobs_notify();
     // Show the prompt if terminal is attached to the std in
-    if(isatty(STDIN_FILENO))
-      printf("%s%% ", hostname);
-    fflush(NULL);
+    if(isatty(STDIN_FILENO)) {
+      printf("%s%% ", host_name());
+      fflush(NULL);
+    }
     // Parse the pipe which can be made of multiple commands
+    trace_begin("parse", NULL);
     p = parse();
+    trace_end("parse", TRACE_NONE, TRACE_NONE);
     if(p == NULL)
       continue;
     if(is_empty_or_end(p))
@@ -829,6 +1868,8 @@ int main(int argc, char *argv[])
     executePipe(p);
     freePipe(p);
   }
+  fflush(NULL);
+  return last_status;
 }
 
 /*........................ end of main.c ....................................*/
@@ -0,0 +1,344 @@
+/******************************************************************************
+ *
+ *  File Name........: parallel.c
+ *
+ *  Description......:
+ *	The parallel builtin: runs a command once for each item, keeping up
+ *  to N of them running at a time.  The command was looked up in PATH
+ *  once by the caller, every item is started with spawn_process() from
+ *  launch.c.
+ *
+ *  Each running job is watched by the event loop (events.c) and the
+ *  shell sleeps in it until one of them is done, then the next item is
+ *  started in the free slot.  A job writes its stdout and stderr to memfds,
+ *  which are copied to the shell's own stdout and stderr when the job is
+ *  done, so the output of two jobs never interleaves.
+ *
+ *  The concurrently builtin uses the same slots to run whole command
+ *  lines at once, each one in a ush -c of its own, and reports how each
+ *  of them ended.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "parallel.h"
+#include "launch.h"
+#include "copy.h"
+#include "env.h"
+#include "events.h"
+
+// a running job
+struct slot {
+  pid_t pid;
+  int done, status;		// the wait status once it is done
+  int out, err;			// memfds the output goes to, -1 if none
+  int index;			// which command line, for concurrently
+};
+
+// where the items come from, the arguments or the lines of stdin
+static char **item_list;
+static int item_count, next_item;
+static char *line = NULL;
+static size_t line_size = 0;
+
+static char *next_item_text() {
+  ssize_t n;
+
+  if(item_list != NULL)
+    return next_item < item_count ? item_list[next_item++] : NULL;
+
+  n = getline(&line, &line_size, stdin);
+  if(n < 0)
+    return NULL;
+  if(n > 0 && line[n - 1] == '\n')
+    line[n - 1] = '\0';
+  return line;
+}
+
+/*
+ * Puts the item into a word of the command
+ * {} is the item and {.} the item without its extension.  Returns a
+ * malloc'd string, or NULL if the word has neither.
+ */
+static char *substitute(const char *word, const char *item) {
+  const char *p, *dot, *slash;
+  char *result, *r;
+  int count = 0, item_len = strlen(item), len;
+
+  for(p = word; (p = strchr(p, '{')) != NULL; p++)
+    if(!strncmp(p, "{}", 2) || !strncmp(p, "{.}", 3))
+      count++;
+  if(count == 0)
+    return NULL;
+
+  // {.} drops the extension of the last path component
+  dot = strrchr(item, '.');
+  slash = strrchr(item, '/');
+  if(dot == NULL || (slash != NULL && dot < slash) || dot == item || dot[-1] == '/')
+    dot = item + item_len;
+
+  result = r = malloc(strlen(word) + count * item_len + 1);
+  for(p = word; *p != '\0'; ) {
+    if(!strncmp(p, "{}", 2)) {
+      memcpy(r, item, item_len);
+      r += item_len;
+      p += 2;
+    } else if(!strncmp(p, "{.}", 3)) {
+      len = dot - item;
+      memcpy(r, item, len);
+      r += len;
+      p += 3;
+    } else {
+      *r++ = *p++;
+    }
+  }
+  *r = '\0';
+  return result;
+}
+
+// The event loop's handler for the job of a slot
+static void slot_changed(pid_t pid, int status, const struct rusage *usage, void *data) {
+  struct slot *slot = data;
+
+  // Only the end counts, usage is there for nothing else
+  if(usage == NULL)
+    return;
+  slot -> done = 1;
+  slot -> status = status;
+}
+
+// Starts a job in a slot, watched by the event loop
+// Returns 0, or -1 if it could not be started
+static int spawn_slot(struct slot *slot, struct spawn_attr *attr) {
+  int error;
+
+  slot -> pid = spawn_process(attr, &error);
+  if(slot -> pid < 0) {
+    fprintf(stderr, "%s: %s\n", attr -> path, strerror(error));
+    slot -> pid = 0;
+    return -1;
+  }
+  slot -> done = 0;
+  event_child(slot -> pid, slot_changed, slot);
+  return 0;
+}
+
+// Frees the slot of a job that is done, prints its output if it was
+// kept back.  Returns the wait status
+static int reap_slot(struct slot *slot) {
+  slot -> pid = 0;
+
+  if(slot -> out >= 0) {
+    lseek(slot -> out, 0, SEEK_SET);
+    copy_fd(slot -> out, STDOUT_FILENO);
+    close(slot -> out);
+  }
+  if(slot -> err >= 0) {
+    lseek(slot -> err, 0, SEEK_SET);
+    copy_fd(slot -> err, STDERR_FILENO);
+    close(slot -> err);
+  }
+  return slot -> status;
+}
+
+/*
+ * Starts the command for one item in a free slot
+ * Without {} in the command the item is its last argument.
+ * Returns 0, or -1 if the job could not be started.
+ */
+static int start_job(struct slot *slot, char *path, char **template, int ntemplate,
+                     const char *item, int devnull) {
+  struct spawn_attr attr;
+  char **argv;
+  int *substituted;
+  int i, argc = 0, rc, used = 0;
+
+  argv = malloc((ntemplate + 2) * sizeof(char *));
+  substituted = calloc(ntemplate + 1, sizeof(int));
+  for(i = 0; i < ntemplate; i++) {
+    argv[argc] = substitute(template[i], item);
+    if(argv[argc] != NULL) {
+      substituted[argc] = used = 1;
+    } else {
+      argv[argc] = template[i];
+    }
+    argc++;
+  }
+  if(!used)
+    argv[argc++] = (char *)item;
+  argv[argc] = NULL;
+
+  slot -> out = memfd_create("parallel-out", MFD_CLOEXEC);
+  slot -> err = memfd_create("parallel-err", MFD_CLOEXEC);
+
+  spawn_attr_init(&attr);
+  attr.path = path;
+  attr.argv = argv;
+  attr.envp = env_envp();
+  attr.fds[0] = devnull;
+  attr.fds[1] = slot -> out;
+  attr.fds[2] = slot -> err;
+  rc = spawn_slot(slot, &attr);
+
+  for(i = 0; i < argc; i++)
+    if(substituted[i])
+      free(argv[i]);
+  free(argv);
+  free(substituted);
+
+  if(rc < 0) {
+    close(slot -> out);
+    close(slot -> err);
+  }
+  return rc;
+}
+
+/*
+ * Runs path with the words of template for each item, jobs at a time
+ * The items are items[0..nitems-1], or the lines of stdin if items is
+ * NULL.  Returns the number of jobs that failed, at most 101 like GNU
+ * parallel.
+ */
+int parallel_run(char *path, char **template, int ntemplate,
+                 char **items, int nitems, int jobs) {
+  struct slot *slots;
+  int devnull, running = 0, failed = 0;
+  int i, status;
+  char *item;
+
+  item_list = items;
+  item_count = nitems;
+  next_item = 0;
+
+  slots = calloc(jobs, sizeof(struct slot));
+  devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  // Output of jobs follows whatever the shell printed before
+  fflush(NULL);
+
+  item = next_item_text();
+  while(item != NULL || running > 0) {
+    // Fill the free slots
+    for(i = 0; i < jobs && item != NULL; i++) {
+      if(slots[i].pid != 0)
+        continue;
+      if(start_job(&slots[i], path, template, ntemplate, item, devnull) == 0)
+        running++;
+      else
+        failed++;
+      item = next_item_text();
+    }
+    if(running == 0)
+      continue;
+
+    events_run(-1);
+    for(i = 0; i < jobs; i++) {
+      if(slots[i].pid == 0 || !slots[i].done)
+        continue;
+      status = reap_slot(&slots[i]);
+      failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      running--;
+    }
+  }
+
+  close(devnull);
+  free(slots);
+  return failed > 101 ? 101 : failed;
+}
+
+// The environment of the ush -c members, without USH_TRACE: each of
+// them would start the trace file over and lose the shell's, and
+// without USH_ZYGOTE: a member runs one line, a zygote of its own for it
+// would only cost a fork
+static char **member_envp() {
+  char **envp = env_envp(), **copy;
+  int i, n;
+
+  for(n = 0; envp[n] != NULL; n++)
+    ;
+  copy = malloc((n + 1) * sizeof(char *));
+  for(i = n = 0; envp[i] != NULL; i++)
+    if(strncmp(envp[i], "USH_TRACE=", 10) && strncmp(envp[i], "USH_ZYGOTE=", 11))
+      copy[n++] = envp[i];
+  copy[n] = NULL;
+  return copy;
+}
+
+/*
+ * Runs the command lines all at once, or jobs at a time if jobs > 0
+ * Each one is run by a ush -c of its own, so it can be a pipeline or a
+ * list.  When one ends its status is reported on stderr.  Returns the
+ * status of the first command line that failed, 0 if none did.
+ */
+int concurrently_run(char **commands, int ncommands, int jobs) {
+  struct spawn_attr attr;
+  struct slot *slots, *slot;
+  char *argv[4];
+  int running = 0, next = 0, result = 0;
+  int *statuses;
+  int i, status;
+
+  if(jobs <= 0 || jobs > ncommands)
+    jobs = ncommands;
+  slots = calloc(jobs, sizeof(struct slot));
+  statuses = calloc(ncommands, sizeof(int));
+  fflush(NULL);
+
+  argv[0] = "ush";
+  argv[1] = "-c";
+  argv[3] = NULL;
+  spawn_attr_init(&attr);
+  attr.path = "/proc/self/exe";
+  attr.argv = argv;
+  attr.envp = member_envp();
+
+  while(next < ncommands || running > 0) {
+    for(i = 0; i < jobs && next < ncommands; i++) {
+      if(slots[i].pid != 0)
+        continue;
+      slots[i].out = slots[i].err = -1;
+      slots[i].index = next;
+      argv[2] = commands[next++];
+      if(spawn_slot(&slots[i], &attr) == 0)
+        running++;
+      else
+        statuses[slots[i].index] = 126;
+    }
+    if(running == 0)
+      continue;
+
+    events_run(-1);
+    for(i = 0; i < jobs; i++) {
+      slot = &slots[i];
+      if(slot -> pid == 0 || !slot -> done)
+        continue;
+      status = reap_slot(slot);
+      if(WIFEXITED(status))
+        status = WEXITSTATUS(status);
+      else
+        status = 128 + WTERMSIG(status);
+      statuses[slot -> index] = status;
+      if(status == 0)
+        fprintf(stderr, "[%d]  Done      %s\n", slot -> index + 1, commands[slot -> index]);
+      else
+        fprintf(stderr, "[%d]  Exit %-5d%s\n", slot -> index + 1, status, commands[slot -> index]);
+      running--;
+    }
+  }
+
+  for(i = 0; i < ncommands && result == 0; i++)
+    result = statuses[i];
+  free(attr.envp);
+  free(slots);
+  free(statuses);
+  return result;
+}
+
+/*........................ end of parallel.c ................................*/
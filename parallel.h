@@ -0,0 +1,17 @@
+/******************************************************************************
+ *
+ *  File Name........: parallel.h
+ *
+ *  Description......: header file for the parallel and concurrently builtins.
+ *
+ *****************************************************************************/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+int parallel_run(char *path, char **template, int ntemplate,
+                 char **items, int nitems, int jobs);
+int concurrently_run(char **commands, int ncommands, int jobs);
+
+#endif /* PARALLEL_H */
+/*........................ end of parallel.h ................................*/
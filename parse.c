@@ -7,6 +7,15 @@
  *  the ash shell.  parse() return a pipe list.  Each element of the
  *  pipe list is a pipe that contains one or more commands.
  *
+ *	All of the pipe list, its commands and their words are allocated
+ *  from an arena.  freePipe() releases all of it at once, and the memory
+ *  is reused for the next line, so once the arena has grown to the size
+ *  of the longest line parsing allocates nothing.
+ *
+ *	A word with an unquoted *, ? or [ gets a glob pattern next to it
+ *  (in Cmd->globs), which the shell expands when it runs the command.
+ *  Quoted and escaped characters in it are escaped with a backslash.
+ *
  *  Author...........: Vincent W. Freeh
  *
  *****************************************************************************/
@@ -15,14 +24,18 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include "parse.h"
 
 #define ERR_MSG		"Invalid input\n"
-#define BUF_SIZE        63
+#define BLOCK_SIZE      65536   // input is read in blocks of this size
+#define CHUNK_SIZE      16384   // smallest arena chunk
+#define CHUNK_KEEP      1048576 // most arena memory kept between lines
+#define ALIGN           16      // arena allocations are aligned to this
 #define EOS             '\0'    // end of string 
 #define Next()		do { LookAhead = nextToken(); } while (0)
+#define Complain(...)	do { ParseErrors++; printf(__VA_ARGS__); } while (0)
 #define LA		LookAhead
-#define ReadChar(c)	do {c = getchar(); if (c < 0) return Terror;} while (0)
 
 // token is valid in a cmd
 #define InCmd(t)	((t)==Tword||(t)==Tin||(t)==Tout|| \
@@ -42,7 +55,45 @@ char *_endd="end";
 static struct cmd_t Empty={Tnil, Tnil, Tnil,"","",1,1,&_empty,NULL};
 static struct cmd_t End={Tnil, Tnil, Tnil,"","",1,1,&_endd,NULL};
 static Token LookAhead;
-static char Word[BUF_SIZE+1];	// this value is valid when LookAhead == Tword
+static char *Word;		// these values are valid when LookAhead == Tword,
+static int WordLen;		// the word is a slice of the input buffer
+static int WordGlob;		// the word has an unquoted *, ? or [
+static int *QuotedAt = NULL;	// offsets of the quoted ones (and of \) in it
+static int NumQuoted = 0, MaxQuoted = 0;
+
+// input buffer, Buf[Pos] is the next char to be read and Buf[Len] is
+// where the next block goes
+static int InputFd = 0;
+static void (*WaitInput)(int fd) = NULL;
+static char *Buf = NULL;
+static int BufSize = 0, Pos = 0, Len = 0;
+static int AtEof = 0;
+
+// arena, the chunk in use is the first one in the list
+struct chunk {
+  struct chunk *next;
+  size_t size, used;
+  char data[];
+};
+static struct chunk *Arena = NULL;
+static int LiveTrees = 0;	// pipe lists returned by parse() not yet freed
+static int ParseErrors = 0;	// errors reported so far
+
+// args of the command being read, copied to the arena when it is done
+static char **ArgBuf = NULL;
+static char **GlobBuf = NULL;	// glob pattern of each arg, or NULL
+static int ArgMax = 0;
+static int CmdGlobs = 0;	// number of args with a pattern
+
+// character classes for the lexer
+enum {Cword, Cblank, Cspecial, Cquote, Cescape, Cglob};
+static const unsigned char CharClass[256] = {
+  [' '] = Cblank, ['\t'] = Cblank,
+  ['\n'] = Cspecial, ['&'] = Cspecial, [';'] = Cspecial,
+  ['<'] = Cspecial, ['|'] = Cspecial, ['>'] = Cspecial,
+  ['\''] = Cquote, ['"'] = Cquote, ['\\'] = Cescape,
+  ['*'] = Cglob, ['?'] = Cglob, ['['] = Cglob
+};
 
 // extern functions
 extern void *malloc(size_t);
@@ -50,11 +101,15 @@ extern void *realloc(void *, size_t);
 
 // forward decls
 void *ckmalloc(unsigned);
-static char *mkWord(char *);
-static Cmd newCmd(char *);
-static void freeCmd(Cmd);
+static void *arenaAlloc(size_t);
+static void arenaReset();
+static char *mkWord(char *, int);
+static char *mkPattern(char *);
+static void noteQuoted(int);
+static Cmd newCmd(char *, int);
 static Cmd mkCmd();
 static Pipe mkPipe();
+static Pipe mkPipeList();
 static Token nextToken();
 
 /*-----------------------------------------------------------------------------
@@ -62,7 +117,7 @@ static Token nextToken();
  * Name...........: mkCmd
  *
  * Description....: reads stdin and creates a Cmd (struct cmd_t*).  The
- * Cmd that is returned should be freed with freeCmd().
+ * Cmd lives in the arena, with the pipe list it becomes part of.
  *
  * Input Param(s).: Token inpipe -- if in a pipe, then this is the
  * pipe command, otherwise it is Tnil.
@@ -85,7 +140,7 @@ static Cmd mkCmd(Token inpipe)
     if ( LA == Tnl || LA == Terror )
       // don't complain about empty lines or twice about same error
       return &Empty;
-    printf(ERR_MSG);
+    Complain(ERR_MSG);
 #if 0
     while ( !CmdToken(LA) && !EndOfInput(LA) )	// kill rest of pipe
       Next();
@@ -94,7 +149,7 @@ static Cmd mkCmd(Token inpipe)
   }
 
   assert(LA == Tword);
-  c = newCmd(Word);
+  c = newCmd(Word, WordLen);
   Next();
   c->in = inpipe;
 
@@ -102,26 +157,24 @@ static Cmd mkCmd(Token inpipe)
     switch ( LA ) {
     case Tin:
       if ( c->in != Tnil ) {	// two Tin in one command
-	printf("Ambiguous input redirect.\n");
+	Complain("Ambiguous input redirect.\n");
 	// skip to end of line
 	do {
 	  Next();
 	} while ( !EndOfInput(LA) );
-	freeCmd(c);
 	return NULL;
       }
       c->in = LA;
       Next();
       if ( LA != Tword ) {
-	printf(ERR_MSG);
+	Complain(ERR_MSG);
 	// skip to end of line
 	do {
 	  Next();
 	} while ( !EndOfInput(LA) );
-	freeCmd(c);
 	return NULL;
       }	
-      c->infile = mkWord(Word);		// save "in" file
+      c->infile = mkWord(Word, WordLen);	// save "in" file
       Next();
       break;
 
@@ -130,44 +183,42 @@ static Cmd mkCmd(Token inpipe)
     case Tapp:
     case TappErr:
       if ( c->out != Tnil ) {
-	printf("Ambiguous output redirect.\n");
+	Complain("Ambiguous output redirect.\n");
 	// skip to end of line
 	do {
 	  Next();
 	} while ( !EndOfInput(LA) );
-	freeCmd(c);
 	return NULL;
       }
       c->out = LA;			// remember which kind
       Next();
       if ( LA != Tword) {
-	printf(ERR_MSG);
+	Complain(ERR_MSG);
 	// skip to end of line
 	do {
 	  Next();
 	} while ( !EndOfInput(LA) );
-	freeCmd(c);
 	return NULL;
       }
-      c->outfile = mkWord(Word);	// save "out" file
+      c->outfile = mkWord(Word, WordLen);	// save "out" file
       Next();
       break;
 
     case Tword:
-      if ( c->args == NULL ) {
-	printf("Hmmm...\n");
-	exit(-2);
-      }
       // if we've exceeded the size of the arg array double it
-      if ( c->nargs + 2 > c->maxargs ) {
-	c->maxargs += c->maxargs;
-	c->args = realloc(c->args, c->maxargs*sizeof(char *));
-	if ( c->args == NULL ) {
+      if ( c->nargs + 2 > ArgMax ) {
+	ArgMax += ArgMax;
+	ArgBuf = realloc(ArgBuf, ArgMax*sizeof(char *));
+	GlobBuf = realloc(GlobBuf, ArgMax*sizeof(char *));
+	if ( ArgBuf == NULL || GlobBuf == NULL ) {
 	  perror("realloc");
 	  exit(errno);
 	}
       }
-      c->args[c->nargs++] = mkWord(Word);	// save the arg
+      ArgBuf[c->nargs] = mkWord(Word, WordLen);	// save the arg
+      GlobBuf[c->nargs] = mkPattern(ArgBuf[c->nargs]);
+      CmdGlobs += GlobBuf[c->nargs] != NULL;
+      c->nargs++;
       Next();
       break;
 
@@ -177,17 +228,23 @@ static Cmd mkCmd(Token inpipe)
       break;
     }
   }
-  if ( LA == Terror ) {		// shouldn't happen, but what the heck ...
-    freeCmd(c);
+  if ( LA == Terror )		// shouldn't happen, but what the heck ...
     return NULL;
-  }
   if ( LA == Tsemi )		// skip over ending semi
     Next();
   else if ( LA == Tamp ){	// remember the &
     c->exec = Tamp;
     Next();
   }
-  c->args[c->nargs] = NULL;
+  ArgBuf[c->nargs] = NULL;
+  c->maxargs = c->nargs + 1;
+  c->args = arenaAlloc(c->maxargs*sizeof(char *));
+  memcpy(c->args, ArgBuf, c->maxargs*sizeof(char *));
+  if ( CmdGlobs > 0 ) {
+    c->globs = arenaAlloc(c->maxargs*sizeof(char *));
+    memcpy(c->globs, GlobBuf, c->nargs*sizeof(char *));
+    c->globs[c->nargs] = NULL;
+  }
   return c;
 } /*---------- End of mkCmd -------------------------------------------------*/
 
@@ -195,12 +252,13 @@ static Cmd mkCmd(Token inpipe)
  *
  * Name...........: mkPipe
  *
- * Description....: Groups commands in a pipe.  Creates a list of
- * pipe, each of which contains one or more commands.
+ * Description....: Groups commands in a pipe.  Reads one pipe of the
+ * line, mkPipeList() puts them in a list.
  *
  * Input Param(s).: none
  *
- * Return Value(s): Pipe (struct pipe_t*)
+ * Return Value(s): Pipe (struct pipe_t*), or NULL on an empty line or
+ * an error
  *
  */
 
@@ -216,7 +274,7 @@ static Pipe mkPipe()
     return NULL;
 
   // allocate the pipe structure
-  p = ckmalloc(sizeof(*p));
+  p = arenaAlloc(sizeof(*p));
   p->type = Pout;	// set type to Pout until we know differently
   p->head = c;
 
@@ -226,12 +284,11 @@ static Pipe mkPipe()
     else if(LA == Tpipe)
       p->type = Pout;     //reset type
     if ( c->out != Tnil ) {
-      printf("Ambiguous output redirect.\n");
+      Complain("Ambiguous output redirect.\n");
       // skip to end of command
       do { 
 	Next();
       } while ( !EndOfInput(LA) );
-      freeCmd(c);
       return NULL;
     } else
       c->out = p->type == Pout ? Tpipe : TpipeErr;
@@ -239,7 +296,7 @@ static Pipe mkPipe()
     c->next = mkCmd(p->type == Pout ? Tpipe : TpipeErr);
     if ( c->next == NULL || c->next == &Empty ) {
       if ( c->next == &Empty )
-	printf("Invalid null command.\n");
+	Complain("Invalid null command.\n");
       while ( !EndOfInput(LA) )
 	Next();
       return NULL;
@@ -247,22 +304,43 @@ static Pipe mkPipe()
     c = c->next;
   }
 
-  // read next pipe on the line
   p->next = NULL;
-  while ( !EndOfInput(LA) ) {
-    p->next = mkPipe();
-    if ( !p->next )
-      break;
-  }
   return p;
 } /*---------- End of mkPipe ------------------------------------------------*/
 
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: mkPipeList
+ *
+ * Description....: reads the pipes of a line into a list, in one loop
+ * so a line of any number of pipes takes no more stack than one.  A
+ * pipe with an error ends the list, the ones before it are kept.
+ *
+ * Input Param(s).: none
+ *
+ * Return Value(s): Pipe (struct pipe_t*), NULL if there was none
+ *
+ */
+
+static Pipe mkPipeList()
+{
+  Pipe head = NULL, *tail = &head;
+
+  do {
+    if ( (*tail = mkPipe()) == NULL )
+      break;
+    tail = &(*tail)->next;
+  } while ( !EndOfInput(LA) );
+  return head;
+} /*---------- End of mkPipeList --------------------------------------------*/
+
 /*-----------------------------------------------------------------------------
  *
  * Name...........: parse
  *
  * Description....: external interface to this file.
- * Set the LookAhead token, then makes a pipe list.
+ * Set the LookAhead token, then makes a pipe list.  The pipe list
+ * must be freed with freePipe().
  *
  * Input Param(s).: none
  *
@@ -274,11 +352,128 @@ Pipe parse()
 {
   Pipe p;
 
+  // nothing in the arena is in use, whatever a failed parse left there
+  // can go
+  if ( LiveTrees == 0 )
+    arenaReset();
+
   Next();		// prime lookahead
-  p = mkPipe();
+  p = mkPipeList();
+  if ( p != NULL )
+    LiveTrees++;
   return p;
 } /*---------- End of parse -------------------------------------------------*/
 
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: startTree
+ *
+ * Description....: for a pipe list that is built with parseAlloc()
+ * instead of being parsed (see script.c).  Makes room in the arena the
+ * way parse() does and counts the list as in use until freePipe().
+ *
+ * Input Param(s).: none
+ *
+ * Return Value(s): none
+ *
+ */
+
+void startTree()
+{
+  if ( LiveTrees == 0 )
+    arenaReset();
+  LiveTrees++;
+} /*---------- End of startTree ---------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: parseErrors
+ *
+ * Description....: tells how many syntax errors parse() has reported,
+ * a script that had some is not compiled.
+ *
+ * Input Param(s).: none
+ *
+ * Return Value(s): the number of errors so far
+ *
+ */
+
+int parseErrors()
+{
+  return ParseErrors;
+} /*---------- End of parseErrors -------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: setParseInput
+ *
+ * Description....: makes parse() read from another file descriptor.
+ * Whatever was read ahead from the previous one is dropped.
+ *
+ * Input Param(s).: int fd -- the descriptor to read commands from
+ *
+ * Return Value(s): none
+ *
+ */
+
+void setParseInput(int fd)
+{
+  InputFd = fd;
+  Pos = Len = 0;
+  AtEof = 0;
+} /*---------- End of setParseInput -----------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: setParseWait
+ *
+ * Description....: sets a function that is called before parse() reads
+ * from its descriptor, to do other work until there is input.
+ *
+ * Input Param(s).: void (*wait)(int fd) -- called with the descriptor,
+ * returns when it can be read.  NULL reads right away.
+ *
+ * Return Value(s): none
+ *
+ */
+
+void setParseWait(void (*wait)(int fd))
+{
+  WaitInput = wait;
+} /*---------- End of setParseWait ------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: setParseString
+ *
+ * Description....: makes parse() read the commands in a string, for
+ * ush -c.  Nothing is read from a descriptor after that.
+ *
+ * Input Param(s).: const char *s -- the commands
+ *
+ * Return Value(s): none
+ *
+ */
+
+void setParseString(const char *s)
+{
+  int n = strlen(s);
+
+  if ( n + 1 > BufSize ) {
+    BufSize = n + 1;
+    Buf = realloc(Buf, BufSize);
+    if ( Buf == NULL ) {
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  memcpy(Buf, s, n);
+  InputFd = -1;
+  Pos = 0;
+  Len = n;
+  AtEof = 1;
+} /*---------- End of setParseString ----------------------------------------*/
+
 /*-----------------------------------------------------------------------------
  *
  * Name...........: ckmalloc
@@ -304,62 +499,309 @@ void *ckmalloc(unsigned l)
   return p;
 } /*---------- End of ckmalloc ----------------------------------------------*/
 
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: arenaAlloc
+ *
+ * Description....: allocates space in the arena.  Starts a new chunk,
+ * twice the size of the last one, when the current chunk is full.
+ *
+ * Input Param(s).: 
+ *		size_t l -- length to be allocated
+ *
+ * Return Value(s): void* pointer to arena space.
+ *
+ */
+
+static void *arenaAlloc(size_t l)
+{
+  struct chunk *ch;
+  size_t size;
+  void *p;
+
+  l = (l + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+  if ( Arena == NULL || Arena->used + l > Arena->size ) {
+    size = Arena ? Arena->size * 2 : CHUNK_SIZE;
+    if ( size < l )
+      size = l;
+    ch = ckmalloc(sizeof(*ch) + size);
+    ch->size = size;
+    ch->used = 0;
+    ch->next = Arena;
+    Arena = ch;
+  }
+  p = Arena->data + Arena->used;
+  Arena->used += l;
+  return p;
+} /*---------- End of arenaAlloc --------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: parseAlloc
+ *
+ * Description....: allocates space that lives as long as the pipe lists
+ * parse() returned, for what the shell puts into them (the expanded
+ * args).  It goes away with them, nothing is freed separately.
+ *
+ * Input Param(s).: 
+ *		size_t l -- length to be allocated
+ *
+ * Return Value(s): void* pointer to arena space.
+ *
+ */
+
+void *parseAlloc(size_t l)
+{
+  return arenaAlloc(l);
+} /*---------- End of parseAlloc --------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: arenaReset
+ *
+ * Description....: releases everything allocated in the arena.  If the
+ * last line needed more than one chunk they are replaced by one chunk
+ * as big as all of them (up to CHUNK_KEEP), so the next line of that
+ * size fits without a malloc.
+ *
+ * Input Param(s).: none
+ *
+ * Return Value(s): none
+ *
+ */
+
+static void arenaReset()
+{
+  struct chunk *ch, *next;
+  size_t total = 0;
+
+  if ( ArgBuf == NULL ) {
+    ArgMax = 16;
+    ArgBuf = ckmalloc(ArgMax*sizeof(char *));
+    GlobBuf = ckmalloc(ArgMax*sizeof(char *));
+  }
+
+  if ( Arena == NULL )
+    return;
+  if ( Arena->next == NULL ) {
+    Arena->used = 0;
+    return;
+  }
+
+  for ( ch = Arena; ch != NULL; ch = next ) {
+    next = ch->next;
+    total += ch->size;
+    free(ch);
+  }
+  if ( total > CHUNK_KEEP )
+    total = CHUNK_KEEP;
+  Arena = ckmalloc(sizeof(*Arena) + total);
+  Arena->size = total;
+  Arena->used = 0;
+  Arena->next = NULL;
+} /*---------- End of arenaReset --------------------------------------------*/
+
 /*-----------------------------------------------------------------------------
  *
  * Name...........: mkWord
  *
- * Description....: allocates space for a string and copies bytes to it.
+ * Description....: allocates arena space for a string and copies bytes
+ * to it.
  *
  * Input Param(s).: 
- *		char *s -- a string
+ *		char *s -- a string, need not be terminated
+ *		int len -- its length
  *
- * Return Value(s): a string on the head
+ * Return Value(s): a string in the arena
  *
  */
 
-static char *mkWord(char *s)
+static char *mkWord(char *s, int len)
 {
   char *b;
 
-  b = ckmalloc(strlen(s)+1);
-  strcpy(b, s);
+  b = arenaAlloc(len+1);
+  memcpy(b, s, len);
+  b[len] = EOS;
   return b;
 } /*---------- End of mkWord ------------------------------------------------*/
 
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: mkPattern
+ *
+ * Description....: makes the glob pattern of the word just read, the
+ * word with its quoted *, ?, [ and \ escaped by a backslash.
+ *
+ * Input Param(s).: 
+ *		char *word -- the word, as saved by mkWord()
+ *
+ * Return Value(s): the pattern, or NULL if the word is not expanded
+ *
+ */
+
+static char *mkPattern(char *word)
+{
+  char *b;
+  int i, j, q;
+
+  if ( !WordGlob )
+    return NULL;
+  if ( NumQuoted == 0 )
+    return word;
+
+  b = arenaAlloc(WordLen + NumQuoted + 1);
+  for ( i = j = q = 0; i < WordLen; i++ ) {
+    if ( q < NumQuoted && QuotedAt[q] == i ) {
+      b[j++] = '\\';
+      q++;
+    }
+    b[j++] = word[i];
+  }
+  b[j] = EOS;
+  return b;
+} /*---------- End of mkPattern ---------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: noteQuoted
+ *
+ * Description....: remembers that the char at an offset of the word
+ * being read was quoted and is special to glob.
+ *
+ * Input Param(s).: int at -- its offset in the word
+ *
+ * Return Value(s): none
+ *
+ */
+
+static void noteQuoted(int at)
+{
+  if ( NumQuoted == MaxQuoted ) {
+    MaxQuoted = MaxQuoted ? MaxQuoted * 2 : 16;
+    QuotedAt = realloc(QuotedAt, MaxQuoted*sizeof(int));
+    if ( QuotedAt == NULL ) {
+      perror("realloc");
+      exit(errno);
+    }
+  }
+  QuotedAt[NumQuoted++] = at;
+} /*---------- End of noteQuoted --------------------------------------------*/
+
 /*-----------------------------------------------------------------------------
  *
  * Name...........: newCmd
  *
  * Description....: allocates a new Cmd structure.  Initializes it
- * with sane values
+ * with sane values.  Its args are collected in ArgBuf until mkCmd()
+ * is done with it.
  *
  * Input Param(s).: 
  *		char *cmd -- the command name (a word).
+ *		int len -- its length
  *
  * Return Value(s): a Cmd structure
  *
  */
 
-static Cmd newCmd(char *cmd)
+static Cmd newCmd(char *cmd, int len)
 {
   Cmd c;
-  c = ckmalloc(sizeof(*c));
+  c = arenaAlloc(sizeof(*c));
   c->nargs = 1;
-  c->maxargs = 4;
-  c->args = ckmalloc(c->maxargs*sizeof(char*));
-  c->args[0] = mkWord(cmd);
+  c->maxargs = 0;
+  c->args = NULL;
+  ArgBuf[0] = mkWord(cmd, len);
+  GlobBuf[0] = mkPattern(ArgBuf[0]);
+  CmdGlobs = GlobBuf[0] != NULL;
   c->exec = Tsemi;
   c->in = c->out = Tnil;
   c->infile = c->outfile = NULL;
   c->next = NULL;
+  c->globs = NULL;
   return c;
 } /*---------- End of newCmd ------------------------------------------------*/
 
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: fill
+ *
+ * Description....: reads the next block of input into the buffer.
+ * Everything before Buf[*keep] has been used and is dropped, the rest
+ * is moved to the front of the buffer.  The buffer grows when it is
+ * full, so a word can be of any length.
+ *
+ * Input Param(s).: int *keep -- index of the first byte still needed,
+ * updated to where that byte is afterwards.
+ *
+ * Return Value(s): number of bytes read, 0 at end of input
+ *
+ */
+
+static int fill(int *keep)
+{
+  int n;
+
+  if ( *keep > 0 ) {
+    memmove(Buf, Buf + *keep, Len - *keep);
+    Len -= *keep;
+    Pos -= *keep;
+    *keep = 0;
+  }
+  if ( AtEof )
+    return 0;
+
+  if ( Len == BufSize ) {
+    BufSize = BufSize ? BufSize * 2 : BLOCK_SIZE;
+    Buf = realloc(Buf, BufSize);
+    if ( Buf == NULL ) {
+      perror("realloc");
+      exit(errno);
+    }
+  }
+
+  if ( WaitInput != NULL )
+    WaitInput(InputFd);
+  do {
+    n = read(InputFd, Buf + Len, BufSize - Len);
+  } while ( n < 0 && errno == EINTR );
+  if ( n <= 0 ) {
+    AtEof = 1;
+    return 0;
+  }
+  Len += n;
+  return n;
+} /*---------- End of fill -------------------------------------------------*/
+
+/*-----------------------------------------------------------------------------
+ *
+ * Name...........: peekChar
+ *
+ * Description....: returns the next char without consuming it.
+ *
+ * Input Param(s).: none
+ *
+ * Return Value(s): the char, or -1 at end of input
+ *
+ */
+
+static int peekChar()
+{
+  int keep = Pos;
+
+  if ( Pos == Len && !fill(&keep) )
+    return -1;
+  return (unsigned char)Buf[Pos];
+} /*---------- End of peekChar ---------------------------------------------*/
+
 /*-----------------------------------------------------------------------------
  *
  * Name...........: nextToken
  *
- * Description....: reads stdin and returns the next token.
+ * Description....: reads the input and returns the next token.  A word
+ * is left in Word/WordLen, a slice of the input buffer with quotes and
+ * backslashes already removed (in place, the word only gets shorter).
+ * WordGlob and QuotedAt tell mkPattern() which chars were quoted.
  *
  * Input Param(s).: none
  *
@@ -369,21 +811,22 @@ static Cmd newCmd(char *cmd)
 
 static Token nextToken()
 {
-  char* p;
-  char c, q;
-
-  Word[0] = EOS;
-  p = Word;
-
-  c = getchar();
-  if ( c < 0 )
-    return Tend;
+  int c, q;
+  int start, len;
+
+  // skip blanks
+  while ( 1 ) {
+    while ( Pos < Len && CharClass[(unsigned char)Buf[Pos]] == Cblank )
+      Pos++;
+    if ( Pos < Len )
+      break;
+    start = Pos;
+    if ( !fill(&start) )
+      return Tend;
+  }
 
+  c = (unsigned char)Buf[Pos++];
   switch ( c ) {
-  case ' ':
-  case '\t':
-    return nextToken();
-
   case '\n':
     return Tnl;
   case '&':
@@ -394,138 +837,104 @@ static Token nextToken()
     return Tin;
 
   case '|':			// could be a | or a |&
-    ReadChar(c);
-    if ( c == '&' )
+    if ( peekChar() == '&' ) {
+      Pos++;
       return TpipeErr;
-    ungetc(c, stdin);		// it's a |, put back the last char
+    }
     return Tpipe;
 
-  case '>':
-    ReadChar(c);		// could be a >, >>, or >>&
+  case '>':			// could be a >, >&, >>, or >>&
+    c = peekChar();
     if ( c == '>' ) {
-      ReadChar(c);
-      if ( c == '&' )
+      Pos++;
+      if ( peekChar() == '&' ) {
+	Pos++;
 	return TappErr;
-      else {
-	ungetc(c, stdin);	// it's a >>, put back last char
-	return Tapp;
       }
+      return Tapp;
     }
-    else if ( c == '&' ) {
+    if ( c == '&' ) {
+      Pos++;
       return ToutErr;
     }
-    else {
-      ungetc(c, stdin);		// it's a >, put back last char
-      return Tout;
-    }
+    return Tout;
+
+  default:		// everything else is a word
     break;
+  }
 
-  case '\'':
-  case '"':
-  string:
-    // process strings
-    q = c;
-    //    p = Word;
-    c = getchar();
-    // get chars until the matching quote character 
-    while ( c != q ) {
-      if ( c < 0 || c == '\n' ) {	
-	// end of input before matching quote
-	printf("Unmatched %c\n", q);
-	return Terror;
-      }
-      *p++ = c;		// copy char to buffer at p
-      if ( p > Word + BUF_SIZE ) {
-	printf("String too long (> %d bytes)\n", BUF_SIZE);
-	while ( (c = getchar()) > 0 && c != '\n' )
-	  ;
-	return Terror;
-      }
-      c = getchar();
+  start = --Pos;
+  len = 0;
+  WordGlob = NumQuoted = 0;
+  while ( 1 ) {
+    // copy plain chars, a no-op until the first quote or backslash
+    while ( Pos < Len && CharClass[(unsigned char)Buf[Pos]] == Cword )
+      Buf[start + len++] = Buf[Pos++];
+    if ( Pos == Len ) {
+      if ( !fill(&start) )
+	break;			// end of input ends the word
+      continue;
     }
-    *p++ = EOS;
-    p = Word;
-    return Tword;
 
-  default:		// everything else is a word
-    //    p = Word;
-    while (1) {
-      if ( c == '\\' ) {	// strip \ from stream
-	ReadChar(c);
+    switch ( CharClass[(unsigned char)Buf[Pos]] ) {
+    case Cblank:
+      Pos++;
+      goto word;
+
+    case Cspecial:		// leave these chars for next time
+      goto word;
+
+    case Cescape:		// strip \ from stream
+      Pos++;
+      if ( Pos == Len && !fill(&start) )
+	goto word;
+      if ( CharClass[(unsigned char)Buf[Pos]] == Cglob || Buf[Pos] == '\\' )
+	noteQuoted(len);
+      Buf[start + len++] = Buf[Pos++];
+      break;
+
+    case Cglob:			// expanded later, see mkPattern()
+      WordGlob = 1;
+      Buf[start + len++] = Buf[Pos++];
+      break;
+
+    case Cquote:
+      // get chars until the matching quote character, that ends the word
+      q = Buf[Pos++];
+      while ( 1 ) {
+	while ( Pos < Len && Buf[Pos] != q && Buf[Pos] != '\n' ) {
+	  if ( CharClass[(unsigned char)Buf[Pos]] >= Cescape )
+	    noteQuoted(len);
+	  Buf[start + len++] = Buf[Pos++];
+	}
+	if ( Pos < Len )
+	  break;
+	if ( !fill(&start) ) {
+	  Complain("Unmatched %c\n", q);
+	  return Terror;
+	}
       }
-      *p++ = c;
-      if ( p > Word + BUF_SIZE ) {
-	printf("Word too long (> %d bytes)\n", BUF_SIZE);
-	while ( (c = getchar()) > 0 && c != '\n' )
-	  ;
+      if ( Buf[Pos++] == '\n' ) {
+	// end of line before matching quote
+	Complain("Unmatched %c\n", q);
 	return Terror;
       }
-
-      ReadChar(c);
-
-      switch ( c ) {
-      case ' ':
-      case '\t':
-	*p++ = EOS;
-	return Tword;
-      case '\n':
-      case '&':
-      case ';':
-      case '<':
-      case '|':
-      case '>':
-	*p++ = EOS;
-	ungetc(c, stdin);	// put back these chars for next time
-	p = Word;		// reset p
-	return Tword;
-      case '\'':
-      case '\"':
-      goto string;
-      default:
-	break;
-      }
+      goto word;
     }
   }
-} /*---------- End of nextToken ---------------------------------------------*/
 
-/*-----------------------------------------------------------------------------
- *
- * Name...........: freeCmd
- *
- * Description....: return heap storage associated with Cd
- *
- * Input Param(s).: 
- *		Cmd c -- the command that is to be freed
- *
- * Return Value(s): none
- *
- */
-
-static void freeCmd(Cmd c)
-{
-  int i;
-
-  if ( c == NULL || c == &Empty || c == &End ) return;
-
-  freeCmd(c->next);
-
-  if ( c->infile )
-    free(c->infile);
-  if ( c->outfile )
-    free(c->outfile);
-  if ( c->args ) {
-    for ( i = 0; i < c->nargs; i++ )
-      free(c->args[i]);
-    free(c->args);
-  }
-  free(c);
-} /*---------- End of freeCmd -----------------------------------------------*/
+ word:
+  Word = Buf + start;
+  WordLen = len;
+  return Tword;
+} /*---------- End of nextToken ---------------------------------------------*/
 
 /*-----------------------------------------------------------------------------
  *
  * Name...........: freePipe
  *
- * Description....: return heap storage for pipe
+ * Description....: return heap storage for pipe.  The pipe lists live in
+ * the arena, which is reset once none of them is in use anymore.
  *
  * Input Param(s).: 
  *		Pipe p -- the pipe to be freed
@@ -539,9 +948,8 @@ void freePipe(Pipe p)
   if ( p == NULL )
     return;
 
-  freeCmd(p->head);
-  freePipe(p->next);
-  free(p);
+  if ( LiveTrees > 0 && --LiveTrees == 0 )
+    arenaReset();
 } /*---------- End of freePipe ----------------------------------------------*/
 
 /*........................ end of parse.c ...................................*/
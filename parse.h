@@ -11,6 +11,8 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <stddef.h>
+
 /* list of all tokens */
 typedef enum {Terror, Tword, Tamp, Tpipe, Tsemi, Tin, Tout,
 	      Tapp, TpipeErr, ToutErr, TappErr, Tnl, Tnil, Tend} Token;
@@ -25,6 +27,8 @@ struct cmd_t {
   int nargs, maxargs;		/* num args in args array below (and size) */
   char **args;			/* argv array -- suitable for execv(1) */
   struct cmd_t *next;
+  char **globs;			/* glob pattern of each arg, or NULL --
+				   NULL if no arg is to be expanded */
 };
 typedef struct cmd_t *Cmd;
 
@@ -43,6 +47,12 @@ typedef struct pipe_t *Pipe;
 
 void freePipe(Pipe);
 Pipe parse();
+void setParseInput(int);
+void setParseString(const char *);
+void setParseWait(void (*)(int));
+void *parseAlloc(size_t);
+void startTree(void);
+int parseErrors(void);
 
 #endif /* PARSE_H */
 /*........................ end of parse.h ...................................*/
@@ -0,0 +1,268 @@
+/******************************************************************************
+ *
+ *  File Name........: pathhash.c
+ *
+ *  Description......:
+ *	Hashed command lookup, like the hash table of csh and bash.  Every
+ *  command name that was looked up is remembered together with the $PATH
+ *  directories it was found in, so running the same command again costs
+ *  no system calls at all.  Names that were not found are remembered too.
+ *
+ *  The table is thrown away when PATH is changed (the shell calls
+ *  pathhash_flush()) or when the modification time of one of the PATH
+ *  directories changes, i.e. a command was added or removed.  The
+ *  directories are stat'ed at most once a second for that.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "pathhash.h"
+#include "env.h"
+
+// How often the PATH directories are checked for changes (seconds)
+#define RECHECK_INTERVAL 1
+
+// A directory from $PATH and what it looked like when it was read
+struct path_dir {
+  char *name;
+  struct timespec mtime;
+  int exists;
+};
+
+// A remembered command
+struct hash_entry {
+  char *name;
+  char *path;			// first match, NULL if there is none (yet)
+  unsigned char *present;	// bitmap of directories that hold name
+  int scanned;			// number of directories looked at so far
+  int hits;
+};
+
+static struct path_dir *dirs = NULL;
+static int num_dirs = 0;
+static int dirs_loaded = 0;
+static time_t last_check = 0;
+
+static struct hash_entry *table = NULL;
+static int table_size = 0;
+static int table_count = 0;
+
+static unsigned int hash_name(const char *s) {
+  unsigned int h = 2166136261u;
+
+  while(*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static time_t now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+// Records the modification time of a directory, returns 1 if it changed
+static int stat_dir(struct path_dir *d) {
+  struct stat sb;
+  int exists = stat(d -> name, &sb) == 0;
+  int changed;
+
+  if(!exists)
+    memset(&sb, 0, sizeof(sb));
+  changed = exists != d -> exists ||
+            sb.st_mtim.tv_sec != d -> mtime.tv_sec ||
+            sb.st_mtim.tv_nsec != d -> mtime.tv_nsec;
+  d -> exists = exists;
+  d -> mtime = sb.st_mtim;
+  return changed;
+}
+
+// Splits $PATH into the directory list
+static void load_dirs() {
+  const char *path_value = env_get("PATH");
+  char *copy, *dir;
+  int max = 8;
+
+  dirs_loaded = 1;
+  last_check = now();
+  if(path_value == NULL)
+    return;
+
+  copy = strdup(path_value);
+  dirs = malloc(max * sizeof(struct path_dir));
+  for(dir = strtok(copy, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+    if(num_dirs == max) {
+      max *= 2;
+      dirs = realloc(dirs, max * sizeof(struct path_dir));
+    }
+    dirs[num_dirs].name = strdup(dir);
+    dirs[num_dirs].exists = 0;
+    stat_dir(&dirs[num_dirs]);
+    num_dirs++;
+  }
+  free(copy);
+}
+
+static void free_entries() {
+  int i;
+
+  for(i = 0; i < table_size; i++) {
+    if(table[i].name == NULL)
+      continue;
+    free(table[i].name);
+    free(table[i].path);
+    free(table[i].present);
+  }
+  free(table);
+  table = NULL;
+  table_size = table_count = 0;
+}
+
+// Forgets the remembered commands if a PATH directory was modified
+static void check_dirs() {
+  int i, changed = 0;
+  time_t t = now();
+
+  if(t - last_check < RECHECK_INTERVAL)
+    return;
+  last_check = t;
+  for(i = 0; i < num_dirs; i++)
+    changed |= stat_dir(&dirs[i]);
+  if(changed)
+    free_entries();
+}
+
+static struct hash_entry *find_slot(struct hash_entry *t, int size, const char *name) {
+  unsigned int i = hash_name(name) & (size - 1);
+
+  while(t[i].name != NULL && strcmp(t[i].name, name))
+    i = (i + 1) & (size - 1);
+  return &t[i];
+}
+
+static void grow_table() {
+  struct hash_entry *old = table;
+  int old_size = table_size;
+  int i;
+
+  table_size = old_size ? old_size * 2 : 64;
+  table = calloc(table_size, sizeof(struct hash_entry));
+  for(i = 0; i < old_size; i++)
+    if(old[i].name != NULL)
+      *find_slot(table, table_size, old[i].name) = old[i];
+  free(old);
+}
+
+static struct hash_entry *get_entry(const char *name) {
+  struct hash_entry *e;
+
+  if(!dirs_loaded)
+    load_dirs();
+  else
+    check_dirs();
+
+  if((table_count + 1) * 4 > table_size * 3)
+    grow_table();
+  e = find_slot(table, table_size, name);
+  if(e -> name == NULL) {
+    e -> name = strdup(name);
+    e -> path = NULL;
+    e -> present = calloc(num_dirs / 8 + 1, 1);
+    e -> scanned = 0;
+    e -> hits = 0;
+    table_count++;
+  }
+  return e;
+}
+
+// Looks for name in the PATH directories not examined yet.  With
+// stop_at_first the scan ends at the first match.
+static void scan_dirs(struct hash_entry *e, int stop_at_first) {
+  char buf[4096];
+  struct path_dir *d;
+
+  while(e -> scanned < num_dirs) {
+    d = &dirs[e -> scanned];
+    if(d -> name[strlen(d -> name) - 1] == '/')
+      snprintf(buf, sizeof(buf), "%s%s", d -> name, e -> name);
+    else
+      snprintf(buf, sizeof(buf), "%s/%s", d -> name, e -> name);
+
+    if(d -> exists && access(buf, F_OK) == 0) {
+      e -> present[e -> scanned / 8] |= 1 << (e -> scanned % 8);
+      if(e -> path == NULL) {
+        e -> path = strdup(buf);
+        if(stop_at_first) {
+          e -> scanned++;
+          return;
+        }
+      }
+    }
+    e -> scanned++;
+  }
+}
+
+const char *pathhash_lookup(const char *name) {
+  struct hash_entry *e = get_entry(name);
+
+  if(e -> path == NULL)
+    scan_dirs(e, 1);
+  e -> hits++;
+  return e -> path;
+}
+
+void pathhash_where(const char *name) {
+  struct hash_entry *e = get_entry(name);
+  int i;
+
+  scan_dirs(e, 0);
+  for(i = 0; i < num_dirs; i++) {
+    if(!(e -> present[i / 8] & (1 << (i % 8))))
+      continue;
+    if(dirs[i].name[strlen(dirs[i].name) - 1] == '/')
+      printf("%s%s\n", dirs[i].name, name);
+    else
+      printf("%s/%s\n", dirs[i].name, name);
+  }
+}
+
+void pathhash_print() {
+  int i;
+
+  if(table_count == 0) {
+    printf("hash: hash table empty\n");
+    return;
+  }
+  printf("hits\tcommand\n");
+  for(i = 0; i < table_size; i++) {
+    if(table[i].name == NULL)
+      continue;
+    if(table[i].path != NULL)
+      printf("%4d\t%s\n", table[i].hits, table[i].path);
+    else if(table[i].scanned == num_dirs)
+      printf("%4d\t%s (not found)\n", table[i].hits, table[i].name);
+  }
+}
+
+void pathhash_flush() {
+  int i;
+
+  free_entries();
+  for(i = 0; i < num_dirs; i++)
+    free(dirs[i].name);
+  free(dirs);
+  dirs = NULL;
+  num_dirs = 0;
+  dirs_loaded = 0;
+}
+
+/*........................ end of pathhash.c ................................*/
@@ -0,0 +1,26 @@
+/******************************************************************************
+ *
+ *  File Name........: pathhash.h
+ *
+ *  Description......: header file for the hashed command lookup table.
+ *
+ *****************************************************************************/
+
+#ifndef PATHHASH_H
+#define PATHHASH_H
+
+// Returns the absolute path of a command found in $PATH or NULL if it is
+// not there.  The string belongs to the table, copy it to keep it.
+const char *pathhash_lookup(const char *name);
+
+// Prints every $PATH match of name, one per line (used by where)
+void pathhash_where(const char *name);
+
+// Prints the remembered commands and how often each was used (hash)
+void pathhash_print(void);
+
+// Forgets everything, called by rehash / hash -r and whenever PATH changes
+void pathhash_flush(void);
+
+#endif /* PATHHASH_H */
+/*........................ end of pathhash.h ................................*/
@@ -0,0 +1,467 @@
+/******************************************************************************
+ *
+ *  File Name........: script.c
+ *
+ *  Description......:
+ *	Compiled scripts.  The first time ush runs a script file (or its
+ *  .ushrc) every line it parses is also written down in a flat image:
+ *  arrays of pipes, commands and argument references that use indexes
+ *  instead of pointers, and a table of the strings, each stored once.
+ *  When the whole script was read without a syntax error the image is
+ *  saved under ~/.cache/ush, in a file named after a hash of the
+ *  script's path.
+ *
+ *  The next run maps that file and builds each line's Pipe straight
+ *  from it, the strings stay in the mapping, so nothing is lexed or
+ *  parsed.  The image records the device, inode, size and modification
+ *  time of the script and is only used while they still match.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parse.h"
+#include "script.h"
+#include "env.h"
+
+#define IMAGE_MAGIC	0x43485355	// "USHC"
+#define IMAGE_VERSION	1
+#define NONE		0xffffffffu	// no string, no globs
+
+// The image starts with this header, the offsets are from its start
+struct image_header {
+  uint32_t magic, version;
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  uint32_t nlines;
+  uint32_t lines, pipes, cmds, refs, strings;	// offsets of the sections
+  uint32_t length;				// of the whole image
+};
+
+// a line is the pipes [pipe, pipe + npipes)
+struct image_line {
+  uint32_t pipe, npipes;
+};
+
+// a pipe is the commands [cmd, cmd + ncmds)
+struct image_pipe {
+  uint32_t type, cmd, ncmds;
+};
+
+// args and globs index refs, which hold string offsets
+struct image_cmd {
+  uint32_t exec, in, out;
+  uint32_t infile, outfile;
+  uint32_t nargs, args, globs;
+};
+
+// a growing array of the image being compiled
+struct section {
+  char *data;
+  size_t used, size;
+};
+
+// the script being compiled
+static struct section lines, pipes, cmds, refs, strings;
+static uint32_t *string_table = NULL;	// hash of strings, offset + 1 or 0
+static uint32_t table_size = 0, table_count = 0;
+static struct stat script_stat;
+static char *image_path = NULL;
+static int compiling = 0;
+
+// the mapped image being run
+static char *image = NULL;
+static size_t image_length;
+static uint32_t next_line;
+
+static void *append(struct section *s, const void *data, size_t size) {
+  void *p;
+
+  if(s -> used + size > s -> size) {
+    s -> size = s -> size ? s -> size * 2 : 4096;
+    while(s -> used + size > s -> size)
+      s -> size *= 2;
+    s -> data = realloc(s -> data, s -> size);
+  }
+  p = s -> data + s -> used;
+  memcpy(p, data, size);
+  s -> used += size;
+  return p;
+}
+
+static uint32_t count(struct section *s, size_t size) {
+  return s -> used / size;
+}
+
+static uint32_t hash_string(const char *s) {
+  uint32_t h = 2166136261u;
+
+  while(*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void grow_strings() {
+  uint32_t *old = string_table, old_size = table_size, i, j;
+
+  table_size = old_size ? old_size * 2 : 1024;
+  string_table = calloc(table_size, sizeof(uint32_t));
+  for(i = 0; i < old_size; i++) {
+    if(old[i] == 0)
+      continue;
+    j = hash_string(strings.data + old[i] - 1) & (table_size - 1);
+    while(string_table[j] != 0)
+      j = (j + 1) & (table_size - 1);
+    string_table[j] = old[i];
+  }
+  free(old);
+}
+
+// Returns the offset of a string in the table, a word used many times
+// is stored once
+static uint32_t add_string(const char *s) {
+  uint32_t i;
+
+  if(s == NULL)
+    return NONE;
+  if((table_count + 1) * 2 > table_size)
+    grow_strings();
+  i = hash_string(s) & (table_size - 1);
+  while(string_table[i] != 0) {
+    if(!strcmp(strings.data + string_table[i] - 1, s))
+      return string_table[i] - 1;
+    i = (i + 1) & (table_size - 1);
+  }
+  string_table[i] = strings.used + 1;
+  table_count++;
+  append(&strings, s, strlen(s) + 1);
+  return string_table[i] - 1;
+}
+
+static uint32_t add_refs(char **words, int n) {
+  uint32_t first = count(&refs, sizeof(uint32_t)), ref;
+  int i;
+
+  for(i = 0; i < n; i++) {
+    ref = add_string(words[i]);
+    append(&refs, &ref, sizeof(ref));
+  }
+  return first;
+}
+
+/*
+ * Names the image of a script: ~/.cache/ush/ and a hash of its path
+ * Returns a malloc'd path, or NULL if there is no home directory.
+ */
+static char *name_image(const char *path) {
+  char full[PATH_MAX], *name;
+  const char *home = env_get("HOME");
+  uint64_t h = 14695981039346656037ull;
+  const char *s;
+
+  if(home == NULL || *home == '\0')
+    return NULL;
+  if(path[0] == '/' || getcwd(full, sizeof(full)) == NULL)
+    snprintf(full, sizeof(full), "%s", path);
+  else
+    snprintf(full + strlen(full), sizeof(full) - strlen(full), "/%s", path);
+  for(s = full; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ull;
+  }
+
+  if(asprintf(&name, "%s/.cache/ush/%016llx.ushc", home, (unsigned long long)h) < 0)
+    return NULL;
+  return name;
+}
+
+// Tells if a mapped image is one of the script as it is now
+static int image_matches(const struct image_header *h, size_t length, const struct stat *sb) {
+  return length >= sizeof(*h) && h -> magic == IMAGE_MAGIC &&
+         h -> version == IMAGE_VERSION && h -> length == length &&
+         h -> dev == sb -> st_dev && h -> ino == sb -> st_ino &&
+         h -> size == sb -> st_size && h -> mtime_sec == sb -> st_mtim.tv_sec &&
+         h -> mtime_nsec == sb -> st_mtim.tv_nsec;
+}
+
+// Tells if off is a string of the table, which ends in a NUL
+static int valid_string(uint32_t off, uint32_t nstrings) {
+  return off < nstrings;
+}
+
+// Tells if [first, first + n) lies within a section of count entries
+static int valid_range(uint32_t first, uint32_t n, uint32_t count) {
+  return (uint64_t)first + n <= count;
+}
+
+/*
+ * Tells if every offset and index in an image stays inside it
+ * An image that was cut short or written over is parsed again instead
+ * of being run off its end.
+ */
+static int image_valid(const struct image_header *h) {
+  const struct image_line *line;
+  const struct image_pipe *ip;
+  const struct image_cmd *ic;
+  const uint32_t *ref;
+  uint32_t npipes, ncmds, nrefs, nstrings, i, k;
+
+  // The sections follow each other in order, each a whole number of entries
+  if(h -> lines != sizeof(*h) || h -> pipes < h -> lines || h -> cmds < h -> pipes ||
+     h -> refs < h -> cmds || h -> strings < h -> refs || h -> length < h -> strings ||
+     (uint64_t)h -> nlines * sizeof(*line) != h -> pipes - h -> lines ||
+     (h -> cmds - h -> pipes) % sizeof(*ip) != 0 ||
+     (h -> refs - h -> cmds) % sizeof(*ic) != 0 ||
+     (h -> strings - h -> refs) % sizeof(*ref) != 0)
+    return 0;
+  npipes = (h -> cmds - h -> pipes) / sizeof(*ip);
+  ncmds = (h -> refs - h -> cmds) / sizeof(*ic);
+  nrefs = (h -> strings - h -> refs) / sizeof(*ref);
+  nstrings = h -> length - h -> strings;
+  if(nstrings > 0 && image[h -> length - 1] != '\0')
+    return 0;
+
+  line = (const struct image_line *)(image + h -> lines);
+  for(i = 0; i < h -> nlines; i++)
+    if(!valid_range(line[i].pipe, line[i].npipes, npipes))
+      return 0;
+  ip = (const struct image_pipe *)(image + h -> pipes);
+  for(i = 0; i < npipes; i++)
+    if(!valid_range(ip[i].cmd, ip[i].ncmds, ncmds))
+      return 0;
+  ref = (const uint32_t *)(image + h -> refs);
+  ic = (const struct image_cmd *)(image + h -> cmds);
+  for(i = 0; i < ncmds; i++) {
+    if((ic[i].infile != NONE && !valid_string(ic[i].infile, nstrings)) ||
+       (ic[i].outfile != NONE && !valid_string(ic[i].outfile, nstrings)) ||
+       !valid_range(ic[i].args, ic[i].nargs, nrefs) ||
+       (ic[i].globs != NONE && !valid_range(ic[i].globs, ic[i].nargs, nrefs)))
+      return 0;
+    // Every argument is a string, a glob may be none
+    for(k = 0; k < ic[i].nargs; k++)
+      if(!valid_string(ref[ic[i].args + k], nstrings))
+        return 0;
+  }
+  for(i = 0; i < nrefs; i++)
+    if(ref[i] != NONE && !valid_string(ref[i], nstrings))
+      return 0;
+  return 1;
+}
+
+/*
+ * Starts running a script, fd is the open script
+ * Returns 1 if its image is mapped and script_next() gives its lines,
+ * 0 if it has to be parsed; the lines parsed are then to be given to
+ * script_add() and script_close() saves them.
+ */
+int script_open(const char *path, int fd) {
+  struct stat sb;
+  int image_fd;
+
+  image = NULL;
+  compiling = 0;
+  free(image_path);
+  image_path = NULL;
+  if(fstat(fd, &script_stat) < 0 || !S_ISREG(script_stat.st_mode))
+    return 0;
+  image_path = name_image(path);
+  if(image_path == NULL)
+    return 0;
+
+  image_fd = open(image_path, O_RDONLY | O_CLOEXEC);
+  if(image_fd >= 0) {
+    if(fstat(image_fd, &sb) == 0 && sb.st_size >= sizeof(struct image_header)) {
+      // Private and writable, the shell may change the words it runs
+      image = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, image_fd, 0);
+      if(image == MAP_FAILED)
+        image = NULL;
+    }
+    close(image_fd);
+    if(image != NULL && image_matches((struct image_header *)image, sb.st_size, &script_stat) &&
+       image_valid((struct image_header *)image)) {
+      image_length = sb.st_size;
+      next_line = 0;
+      return 1;
+    }
+    if(image != NULL)
+      munmap(image, sb.st_size);
+    image = NULL;
+  }
+
+  // Compile it this time
+  lines.used = pipes.used = cmds.used = refs.used = strings.used = 0;
+  if(string_table != NULL)
+    memset(string_table, 0, table_size * sizeof(uint32_t));
+  table_count = 0;
+  compiling = 1;
+  return 0;
+}
+
+// Returns the next line of the mapped image as a pipe list, NULL at
+// its end.  It is freed with freePipe() like one parse() returned.
+Pipe script_next() {
+  struct image_header *h = (struct image_header *)image;
+  struct image_line *line;
+  struct image_pipe *ip;
+  struct image_cmd *ic;
+  uint32_t *r, *g, i, j, k;
+  Pipe head = NULL, *tail = &head, p;
+  Cmd *ctail, c;
+  char *s;
+
+  if(image == NULL || next_line >= h -> nlines)
+    return NULL;
+  s = image + h -> strings;
+  line = (struct image_line *)(image + h -> lines) + next_line++;
+
+  startTree();
+  for(i = 0; i < line -> npipes; i++) {
+    ip = (struct image_pipe *)(image + h -> pipes) + line -> pipe + i;
+    p = parseAlloc(sizeof(*p));
+    p -> type = ip -> type;
+    p -> next = NULL;
+    ctail = &p -> head;
+    for(j = 0; j < ip -> ncmds; j++) {
+      ic = (struct image_cmd *)(image + h -> cmds) + ip -> cmd + j;
+      c = parseAlloc(sizeof(*c));
+      c -> exec = ic -> exec;
+      c -> in = ic -> in;
+      c -> out = ic -> out;
+      c -> infile = ic -> infile == NONE ? NULL : s + ic -> infile;
+      c -> outfile = ic -> outfile == NONE ? NULL : s + ic -> outfile;
+      c -> nargs = ic -> nargs;
+      c -> maxargs = ic -> nargs + 1;
+      c -> args = parseAlloc(c -> maxargs * sizeof(char *));
+      c -> globs = NULL;
+      r = (uint32_t *)(image + h -> refs) + ic -> args;
+      for(k = 0; k < ic -> nargs; k++)
+        c -> args[k] = s + r[k];
+      c -> args[k] = NULL;
+      if(ic -> globs != NONE) {
+        c -> globs = parseAlloc(c -> maxargs * sizeof(char *));
+        g = (uint32_t *)(image + h -> refs) + ic -> globs;
+        for(k = 0; k < ic -> nargs; k++)
+          c -> globs[k] = g[k] == NONE ? NULL : s + g[k];
+        c -> globs[k] = NULL;
+      }
+      c -> next = NULL;
+      *ctail = c;
+      ctail = &c -> next;
+    }
+    *tail = p;
+    tail = &p -> next;
+  }
+  return head;
+}
+
+// Adds a line that was just parsed to the image being compiled, before
+// it runs and the shell changes its words
+void script_add(Pipe p) {
+  struct image_line line;
+  struct image_pipe ip;
+  struct image_cmd ic;
+  Cmd c;
+
+  if(!compiling)
+    return;
+  line.pipe = count(&pipes, sizeof(ip));
+  line.npipes = 0;
+  for(; p != NULL; p = p -> next) {
+    ip.type = p -> type;
+    ip.cmd = count(&cmds, sizeof(ic));
+    ip.ncmds = 0;
+    for(c = p -> head; c != NULL; c = c -> next) {
+      ic.exec = c -> exec;
+      ic.in = c -> in;
+      ic.out = c -> out;
+      ic.infile = add_string(c -> infile);
+      ic.outfile = add_string(c -> outfile);
+      ic.nargs = c -> nargs;
+      ic.args = add_refs(c -> args, c -> nargs);
+      ic.globs = c -> globs != NULL ? add_refs(c -> globs, c -> nargs) : NONE;
+      append(&cmds, &ic, sizeof(ic));
+      ip.ncmds++;
+    }
+    append(&pipes, &ip, sizeof(ip));
+    line.npipes++;
+  }
+  append(&lines, &line, sizeof(line));
+}
+
+// Writes the image next to where it goes and moves it there, so a
+// shell starting at the same time never maps half of one
+static void save_image() {
+  struct image_header h;
+  char *dir, *tmp, *slash;
+  int fd, ok;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = IMAGE_MAGIC;
+  h.version = IMAGE_VERSION;
+  h.dev = script_stat.st_dev;
+  h.ino = script_stat.st_ino;
+  h.size = script_stat.st_size;
+  h.mtime_sec = script_stat.st_mtim.tv_sec;
+  h.mtime_nsec = script_stat.st_mtim.tv_nsec;
+  h.nlines = count(&lines, sizeof(struct image_line));
+  h.lines = sizeof(h);
+  h.pipes = h.lines + lines.used;
+  h.cmds = h.pipes + pipes.used;
+  h.refs = h.cmds + cmds.used;
+  h.strings = h.refs + refs.used;
+  h.length = h.strings + strings.used;
+
+  // ~/.cache/ush may not be there yet
+  dir = strdup(image_path);
+  for(slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+  }
+  free(dir);
+
+  if(asprintf(&tmp, "%s.%d", image_path, getpid()) < 0)
+    return;
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0) {
+    free(tmp);
+    return;
+  }
+  ok = write(fd, &h, sizeof(h)) == sizeof(h) &&
+       write(fd, lines.data, lines.used) == lines.used &&
+       write(fd, pipes.data, pipes.used) == pipes.used &&
+       write(fd, cmds.data, cmds.used) == cmds.used &&
+       write(fd, refs.data, refs.used) == refs.used &&
+       write(fd, strings.data, strings.used) == strings.used;
+  close(fd);
+  if(!ok || rename(tmp, image_path) < 0)
+    unlink(tmp);
+  free(tmp);
+}
+
+/*
+ * Done with a script
+ * complete says it was read to the end without syntax errors, only
+ * then is the image of a script that was parsed saved.
+ */
+void script_close(int complete) {
+  if(image != NULL) {
+    munmap(image, image_length);
+    image = NULL;
+  }
+  if(compiling && complete && strings.used < NONE)
+    save_image();
+  compiling = 0;
+}
+
+/*........................ end of script.c ..................................*/
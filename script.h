@@ -0,0 +1,20 @@
+/******************************************************************************
+ *
+ *  File Name........: script.h
+ *
+ *  Description......: header file for the compiled script images of ush.
+ *
+ *****************************************************************************/
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "parse.h"
+
+int script_open(const char *path, int fd);
+Pipe script_next(void);
+void script_add(Pipe p);
+void script_close(int complete);
+
+#endif /* SCRIPT_H */
+/*........................ end of script.h ..................................*/
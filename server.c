@@ -0,0 +1,239 @@
+/******************************************************************************
+ *
+ *  File Name........: server.c
+ *
+ *  Description......:
+ *	Command server of ush.  ush --server sock sets itself up once (home
+ *  directory, .ushrc) and then waits on a unix socket.
+ *  ush --client sock 'commands' connects to it and sends the command
+ *  line, its working directory and its stdin, stdout and stderr (as
+ *  SCM_RIGHTS descriptors) in one message.
+ *
+ *  The server forks a worker for every request.  The worker starts from
+ *  the warm state of the server, puts the client's descriptors in place,
+ *  runs the commands and sends their exit status back, which the client
+ *  exits with.  The client never initializes a shell of its own.
+ *
+ *  Only the user the server runs as may use it: the socket is made
+ *  readable and writable by its owner alone, and a peer of another user
+ *  is turned away after accept.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "launch.h"
+
+#define MAX_REQUEST	(64 * 1024 + PATH_MAX)	// cwd, a NUL and the commands
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr -> sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr -> sun_path)) {
+    fprintf(stderr, "ush: %s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr -> sun_path, path);
+  return 0;
+}
+
+/*
+ * Runs one request in a forked worker
+ * The request is the working directory, a NUL and the commands, with
+ * three descriptors attached.
+ */
+static void serve(int conn, int (*run)(char *commands)) {
+  static char request[MAX_REQUEST + 1];
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int fds[3], status, i;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = request;
+  iov.iov_len = MAX_REQUEST;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if(n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || cmsg == NULL ||
+     cmsg -> cmsg_type != SCM_RIGHTS || cmsg -> cmsg_len != CMSG_LEN(sizeof(fds))) {
+    fprintf(stderr, "ush: bad request\n");
+    _exit(1);
+  }
+  // The working directory has to end in a NUL
+  if(memchr(request, '\0', n) == NULL) {
+    fprintf(stderr, "ush: bad request\n");
+    _exit(1);
+  }
+  request[n] = '\0';
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  for(i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  if(chdir(request) < 0)
+    perror(request);
+
+  status = run(request + strlen(request) + 1);
+  fflush(NULL);
+  if(write(conn, &status, sizeof(status)) != sizeof(status)) {
+    perror("ush: sending the status");
+    _exit(1);
+  }
+  _exit(0);
+}
+
+// Tells if the peer of conn runs as the same user as the server
+static int same_user(int conn) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return 0;
+  return cred.uid == geteuid();
+}
+
+/*
+ * Serves requests on the socket at socket_path until the server is killed
+ * run executes a command line in the worker and returns its status.
+ */
+int server_run(const char *socket_path, int (*run)(char *commands)) {
+  struct sockaddr_un addr;
+  struct stat sb;
+  int listener, conn, bound;
+  mode_t mask;
+  pid_t pid;
+
+  if(socket_address(socket_path, &addr) < 0)
+    return 1;
+  // A socket left over from an earlier server is replaced, anything else
+  // at the path is not ours to remove
+  if(lstat(socket_path, &sb) == 0) {
+    if(!S_ISSOCK(sb.st_mode)) {
+      fprintf(stderr, "ush: %s: exists and is not a socket\n", socket_path);
+      return 1;
+    }
+    unlink(socket_path);
+  }
+  listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  // The socket is created 0600, no one else may connect to it
+  mask = umask(0077);
+  bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if(!bound || listen(listener, 64) < 0) {
+    perror(socket_path);
+    return 1;
+  }
+
+  // Workers are not waited for, they report to their client
+  signal(SIGCHLD, SIG_IGN);
+  fflush(NULL);
+
+  while(1) {
+    conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if(conn < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      return 1;
+    }
+    if(!same_user(conn)) {
+      close(conn);
+      continue;
+    }
+
+    pid = fork();
+    if(pid == 0) {
+      close(listener);
+      // The worker waits for its own children and starts them itself
+      signal(SIGCHLD, SIG_DFL);
+      zygote_child();
+      serve(conn, run);
+    }
+    if(pid < 0)
+      perror("fork");
+    close(conn);
+  }
+}
+
+/*
+ * Sends the commands to the server and waits for their exit status
+ * Returns the status, or 255 if the server could not be reached.
+ */
+int client_run(const char *socket_path, const char *commands) {
+  static char request[MAX_REQUEST];
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  int sock, status;
+  size_t len;
+  ssize_t n;
+
+  if(getcwd(request, PATH_MAX) == NULL)
+    strcpy(request, "/");
+  len = strlen(request) + 1;
+  if(len + strlen(commands) + 1 > MAX_REQUEST) {
+    fprintf(stderr, "ush: command line too long\n");
+    return 255;
+  }
+  strcpy(request + len, commands);
+  len += strlen(commands) + 1;
+
+  if(socket_address(socket_path, &addr) < 0)
+    return 255;
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if(sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(socket_path);
+    return 255;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = request;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg -> cmsg_level = SOL_SOCKET;
+  cmsg -> cmsg_type = SCM_RIGHTS;
+  cmsg -> cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if(sendmsg(sock, &msg, 0) < 0) {
+    perror("sendmsg");
+    return 255;
+  }
+
+  do {
+    n = read(sock, &status, sizeof(status));
+  } while(n < 0 && errno == EINTR);
+  if(n != sizeof(status)) {
+    fprintf(stderr, "ush: no status from the server\n");
+    return 255;
+  }
+  return status;
+}
+
+/*........................ end of server.c ..................................*/
@@ -0,0 +1,16 @@
+/******************************************************************************
+ *
+ *  File Name........: server.h
+ *
+ *  Description......: header file for the command server of ush.
+ *
+ *****************************************************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+int server_run(const char *socket_path, int (*run)(char *commands));
+int client_run(const char *socket_path, const char *commands);
+
+#endif /* SERVER_H */
+/*........................ end of server.h ..................................*/
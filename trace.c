@@ -0,0 +1,182 @@
+/******************************************************************************
+ *
+ *  File Name........: trace.c
+ *
+ *  Description......:
+ *	Event trace of ush.  When USH_TRACE names a file the shell writes
+ *  begin and end events for what it does (parsing a line, looking up a
+ *  command, starting a stage, setting up redirections, waiting for a
+ *  job) to it in the Chrome trace JSON format, which Perfetto and
+ *  chrome://tracing load.
+ *
+ *  Events are formatted into a buffer in memory and written out when the
+ *  buffer is nearly full and when the shell exits, so tracing costs a few
+ *  hundred nanoseconds per event and no system call.  Without USH_TRACE
+ *  every trace function returns at once.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_BUFFER	65536	// events are written in blocks of about this size
+#define TRACE_EVENT	1024	// longest event, the buffer is flushed before it fills
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static char trace_buffer[TRACE_BUFFER];
+static int trace_len = 0;
+static int trace_events = 0;
+static long trace_pid;
+
+static void write_all(const char *p, int n) {
+  int w;
+
+  while(n > 0) {
+    w = write(trace_fd, p, n);
+    if(w < 0) {
+      if(errno == EINTR)
+        continue;
+      // Nowhere to write to, stop tracing
+      trace_enabled = 0;
+      return;
+    }
+    p += w;
+    n -= w;
+  }
+}
+
+void trace_flush() {
+  if(trace_fd < 0 || trace_len == 0)
+    return;
+  write_all(trace_buffer, trace_len);
+  trace_len = 0;
+}
+
+// Writes what is buffered and ends the JSON array, done at exit and
+// before the shell execs a command in its place
+void trace_close() {
+  if(trace_fd < 0)
+    return;
+  if(trace_len + 4 < TRACE_BUFFER)
+    trace_len += sprintf(trace_buffer + trace_len, "\n]\n");
+  trace_flush();
+  close(trace_fd);
+  trace_fd = -1;
+  trace_enabled = 0;
+}
+
+// Opens the file USH_TRACE names, if it is set
+void trace_init() {
+  const char *path = getenv("USH_TRACE");
+
+  if(path == NULL || *path == '\0')
+    return;
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if(trace_fd < 0) {
+    perror(path);
+    return;
+  }
+  trace_pid = getpid();
+  trace_enabled = 1;
+  trace_len = sprintf(trace_buffer, "[");
+  atexit(trace_close);
+}
+
+// A forked child drops what the shell has not written yet, the shell
+// writes it itself
+void trace_child() {
+  trace_enabled = 0;
+  trace_len = 0;
+  trace_fd = -1;
+}
+
+// Appends s to the buffer as a JSON string
+static void put_string(const char *s) {
+  char *p = trace_buffer + trace_len;
+  char *end = trace_buffer + TRACE_BUFFER - 8;
+  int max = 128;
+
+  *p++ = '"';
+  for(; *s != '\0' && p < end && max > 0; s++, max--) {
+    if(*s == '"' || *s == '\\') {
+      *p++ = '\\';
+      *p++ = *s;
+    } else if((unsigned char)*s < ' ') {
+      p += sprintf(p, "\\u%04x", *s);
+    } else {
+      *p++ = *s;
+    }
+  }
+  *p++ = '"';
+  trace_len = p - trace_buffer;
+}
+
+// Starts an event: {"name":...,"ph":...,"ts":...,"pid":...,"tid":...
+static void put_event(const char *name, char phase) {
+  struct timespec now;
+
+  if(trace_len > TRACE_BUFFER - TRACE_EVENT)
+    trace_flush();
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  trace_len += sprintf(trace_buffer + trace_len, "%s\n{\"name\":",
+                       trace_events++ ? "," : "");
+  put_string(name);
+  trace_len += sprintf(trace_buffer + trace_len,
+                       ",\"ph\":\"%c\",\"ts\":%ld.%03ld,\"pid\":%ld,\"tid\":%ld",
+                       phase, (long)now.tv_sec * 1000000 + now.tv_nsec / 1000,
+                       now.tv_nsec % 1000, trace_pid, trace_pid);
+}
+
+// Ends an event, with the pid and status of a child as its arguments
+static void put_args(long pid, long status) {
+  if(pid != TRACE_NONE && status != TRACE_NONE)
+    trace_len += sprintf(trace_buffer + trace_len,
+                         ",\"args\":{\"pid\":%ld,\"status\":%ld}}", pid, status);
+  else if(pid != TRACE_NONE)
+    trace_len += sprintf(trace_buffer + trace_len, ",\"args\":{\"pid\":%ld}}", pid);
+  else if(status != TRACE_NONE)
+    trace_len += sprintf(trace_buffer + trace_len, ",\"args\":{\"status\":%ld}}", status);
+  else
+    trace_buffer[trace_len++] = '}';
+}
+
+// Begins the event name, detail (a command, a path) may be NULL
+void trace_begin(const char *name, const char *detail) {
+  if(!trace_enabled)
+    return;
+  put_event(name, 'B');
+  if(detail != NULL) {
+    trace_len += sprintf(trace_buffer + trace_len, ",\"args\":{\"detail\":");
+    put_string(detail);
+    trace_len += sprintf(trace_buffer + trace_len, "}");
+  }
+  trace_buffer[trace_len++] = '}';
+}
+
+// Ends the event name, pid and status are TRACE_NONE if there are none
+void trace_end(const char *name, long pid, long status) {
+  if(!trace_enabled)
+    return;
+  put_event(name, 'E');
+  put_args(pid, status);
+}
+
+// An event without a duration, a child that exited
+void trace_instant(const char *name, long pid, long status) {
+  if(!trace_enabled)
+    return;
+  put_event(name, 'i');
+  trace_len += sprintf(trace_buffer + trace_len, ",\"s\":\"t\"");
+  put_args(pid, status);
+}
+
+/*........................ end of trace.c ...................................*/
@@ -0,0 +1,29 @@
+/******************************************************************************
+ *
+ *  File Name........: trace.h
+ *
+ *  Description......: header file for the event trace of ush.
+ *
+ *****************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/types.h>
+
+/* no pid or status for trace_end() and trace_instant() */
+#define TRACE_NONE	(-1L)
+
+extern int trace_enabled;
+
+void trace_init(void);
+void trace_child(void);
+void trace_flush(void);
+void trace_close(void);
+
+void trace_begin(const char *name, const char *detail);
+void trace_end(const char *name, long pid, long status);
+void trace_instant(const char *name, long pid, long status);
+
+#endif /* TRACE_H */
+/*........................ end of trace.h ...................................*/
@@ -0,0 +1,692 @@
+/******************************************************************************
+ *
+ *  File Name........: utils.c
+ *
+ *  Description......:
+ *	Utilities built into ush: test (and [), printf, basename and
+ *  dirname.  Scripts call these in loops, once per file or line, and
+ *  running them in the shell saves a PATH lookup, a fork and an exec
+ *  every time.  They behave like the coreutils programs for the usual
+ *  flags.
+ *
+ *  Each takes argc and argv like main() and returns the exit status:
+ *  0 or 1 for test, 2 if the expression is wrong.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+/*
+ * test
+ */
+
+static char **tokens;		// the expression being evaluated
+static int ntokens, next_token;
+static const char *test_name;	// test or [, for messages
+static int test_error;
+
+static void test_fail(const char *message, const char *arg) {
+  if(!test_error) {
+    if(arg != NULL)
+      fprintf(stderr, "%s: %s: %s\n", test_name, arg, message);
+    else
+      fprintf(stderr, "%s: %s\n", test_name, message);
+  }
+  test_error = 1;
+}
+
+static intmax_t test_integer(const char *s) {
+  char *end;
+  intmax_t n;
+
+  errno = 0;
+  n = strtoimax(s, &end, 10);
+  while(*end == ' ' || *end == '\t')
+    end++;
+  if(errno != 0 || end == s || *end != '\0')
+    test_fail("integer expression expected", s);
+  return n;
+}
+
+static int is_unary(const char *op) {
+  return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+         strchr("bcdefghLkprsStuwxOGnz", op[1]) != NULL;
+}
+
+static int is_binary(const char *op) {
+  static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                              "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+  int i;
+
+  for(i = 0; ops[i] != NULL; i++)
+    if(!strcmp(op, ops[i]))
+      return 1;
+  return 0;
+}
+
+static int unary_test(const char *op, const char *arg) {
+  struct stat st;
+
+  switch(op[1]) {
+  case 'n':
+    return arg[0] != '\0';
+  case 'z':
+    return arg[0] == '\0';
+  case 't':
+    return isatty(test_integer(arg));
+  case 'h':
+  case 'L':
+    return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  case 'r':
+    return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+  case 'w':
+    return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+  case 'x':
+    return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+  }
+
+  if(stat(arg, &st) < 0)
+    return 0;
+  switch(op[1]) {
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'g':
+    return (st.st_mode & S_ISGID) != 0;
+  case 'u':
+    return (st.st_mode & S_ISUID) != 0;
+  case 'k':
+    return (st.st_mode & S_ISVTX) != 0;
+  case 'O':
+    return st.st_uid == geteuid();
+  case 'G':
+    return st.st_gid == getegid();
+  }
+  return 1;	// -e
+}
+
+// Compares modification times, a file that does not exist is older
+static int newer(const char *a, const char *b) {
+  struct stat sa, sb;
+
+  if(stat(a, &sa) < 0)
+    return 0;
+  if(stat(b, &sb) < 0)
+    return 1;
+  if(sa.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+    return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec;
+  return sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+}
+
+static int binary_test(const char *a, const char *op, const char *b) {
+  struct stat sa, sb;
+  intmax_t x, y;
+
+  if(!strcmp(op, "=") || !strcmp(op, "=="))
+    return strcmp(a, b) == 0;
+  if(!strcmp(op, "!="))
+    return strcmp(a, b) != 0;
+  if(!strcmp(op, "<"))
+    return strcoll(a, b) < 0;
+  if(!strcmp(op, ">"))
+    return strcoll(a, b) > 0;
+  if(!strcmp(op, "-nt"))
+    return newer(a, b);
+  if(!strcmp(op, "-ot"))
+    return newer(b, a);
+  if(!strcmp(op, "-ef"))
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+
+  x = test_integer(a);
+  y = test_integer(b);
+  switch(op[1] * 256 + op[2]) {
+  case 'e' * 256 + 'q':
+    return x == y;
+  case 'n' * 256 + 'e':
+    return x != y;
+  case 'l' * 256 + 't':
+    return x < y;
+  case 'l' * 256 + 'e':
+    return x <= y;
+  case 'g' * 256 + 't':
+    return x > y;
+  default:
+    return x >= y;
+  }
+}
+
+static int test_or(void);
+
+// primary: ( expr ) | -op arg | arg op arg | arg
+static int test_primary() {
+  const char *t;
+  int result;
+
+  if(next_token >= ntokens) {
+    test_fail("argument expected", NULL);
+    return 0;
+  }
+  t = tokens[next_token];
+
+  if(next_token + 2 < ntokens && is_binary(tokens[next_token + 1])) {
+    next_token += 3;
+    return binary_test(t, tokens[next_token - 2], tokens[next_token - 1]);
+  }
+  if(!strcmp(t, "(") && next_token + 1 < ntokens) {
+    next_token++;
+    result = test_or();
+    if(next_token >= ntokens || strcmp(tokens[next_token], ")")) {
+      test_fail("')' expected", NULL);
+      return 0;
+    }
+    next_token++;
+    return result;
+  }
+  if(is_unary(t) && next_token + 1 < ntokens) {
+    next_token += 2;
+    return unary_test(t, tokens[next_token - 1]);
+  }
+  next_token++;
+  return t[0] != '\0';
+}
+
+static int test_not() {
+  if(next_token < ntokens - 1 && !strcmp(tokens[next_token], "!")) {
+    next_token++;
+    return !test_not();
+  }
+  return test_primary();
+}
+
+static int test_and() {
+  int result = test_not();
+
+  while(next_token < ntokens && !strcmp(tokens[next_token], "-a")) {
+    next_token++;
+    result = test_not() && result;
+  }
+  return result;
+}
+
+static int test_or() {
+  int result = test_and();
+
+  while(next_token < ntokens && !strcmp(tokens[next_token], "-o")) {
+    next_token++;
+    result = test_and() || result;
+  }
+  return result;
+}
+
+/*
+ * Evaluates a test expression of n arguments
+ * Up to four arguments the POSIX rules decide what they mean, so that
+ * test = = = and test ! -f work as elsewhere.  Longer expressions are
+ * parsed with -o, -a, ! and parentheses.
+ */
+static int test_eval(char **a, int n) {
+  switch(n) {
+  case 0:
+    return 0;
+  case 1:
+    return a[0][0] != '\0';
+  case 2:
+    if(!strcmp(a[0], "!"))
+      return a[1][0] == '\0';
+    if(is_unary(a[0]))
+      return unary_test(a[0], a[1]);
+    test_fail("unary operator expected", a[0]);
+    return 0;
+  case 3:
+    if(is_binary(a[1]))
+      return binary_test(a[0], a[1], a[2]);
+    if(!strcmp(a[0], "!"))
+      return !test_eval(a + 1, 2);
+    if(!strcmp(a[0], "(") && !strcmp(a[2], ")"))
+      return a[1][0] != '\0';
+    if(!strcmp(a[1], "-a"))
+      return a[0][0] != '\0' && a[2][0] != '\0';
+    if(!strcmp(a[1], "-o"))
+      return a[0][0] != '\0' || a[2][0] != '\0';
+    test_fail("binary operator expected", a[1]);
+    return 0;
+  case 4:
+    if(!strcmp(a[0], "!"))
+      return !test_eval(a + 1, 3);
+    if(!strcmp(a[0], "(") && !strcmp(a[3], ")"))
+      return test_eval(a + 1, 2);
+    break;
+  }
+
+  tokens = a;
+  ntokens = n;
+  next_token = 0;
+  n = test_or();
+  if(next_token < ntokens)
+    test_fail("extra argument", tokens[next_token]);
+  return n;
+}
+
+// test expr, or [ expr ]
+int util_test(int argc, char *argv[]) {
+  int result;
+
+  test_name = argv[0];
+  test_error = 0;
+  argc--;
+  if(!strcmp(argv[0], "[")) {
+    if(argc < 1 || strcmp(argv[argc], "]")) {
+      test_fail("missing ']'", NULL);
+      return 2;
+    }
+    argc--;
+  }
+
+  result = test_eval(argv + 1, argc);
+  if(test_error)
+    return 2;
+  return !result;
+}
+
+/*
+ * printf
+ */
+
+static int printf_status;
+
+// Prints the escape at s (after the backslash) and returns how many
+// chars it took.  In %b arguments octal escapes start with \0.  *stop is
+// set by \c, which ends all output.
+static int print_escape(const char *s, int in_b, int *stop) {
+  int n = 0, value = 0, max = 3;
+
+  switch(*s) {
+  case 'a': putchar('\a'); return 1;
+  case 'b': putchar('\b'); return 1;
+  case 'f': putchar('\f'); return 1;
+  case 'n': putchar('\n'); return 1;
+  case 'r': putchar('\r'); return 1;
+  case 't': putchar('\t'); return 1;
+  case 'v': putchar('\v'); return 1;
+  case '\\': putchar('\\'); return 1;
+  case 'c':
+    *stop = 1;
+    return 1;
+  case 'x':
+    for(n = 1; n < 3 && isxdigit((unsigned char)s[n]); n++)
+      value = value * 16 + (isdigit((unsigned char)s[n]) ? s[n] - '0' : (s[n] | 0x20) - 'a' + 10);
+    if(n == 1) {
+      putchar('\\');
+      return 0;
+    }
+    putchar(value);
+    return n;
+  }
+
+  if(*s >= '0' && *s <= '7') {
+    if(in_b && *s == '0') {
+      // \0NNN
+      n = 1;
+    }
+    while(max-- > 0 && s[n] >= '0' && s[n] <= '7')
+      value = value * 8 + s[n++] - '0';
+    putchar(value);
+    return n;
+  }
+
+  // not an escape, printed as it is
+  putchar('\\');
+  if(*s == '\0')
+    return 0;
+  putchar(*s);
+  return 1;
+}
+
+// Prints a string with its escapes expanded, for %b
+static void print_escaped(const char *s, int *stop) {
+  for(; *s != '\0' && !*stop; s++) {
+    if(*s == '\\')
+      s += print_escape(s + 1, 1, stop);
+    else
+      putchar(*s);
+  }
+}
+
+// The value of a numeric argument, 'c is the code of c and an empty or
+// missing one is 0
+static intmax_t printf_integer(const char *s, int is_unsigned) {
+  char *end;
+  intmax_t n;
+
+  if(*s == '\0')
+    return 0;
+  if(*s == '\'' || *s == '"')
+    return (unsigned char)s[1];
+  errno = 0;
+  if(is_unsigned && *s != '-')
+    n = (intmax_t)strtoumax(s, &end, 0);
+  else
+    n = strtoimax(s, &end, 0);
+  if(*end != '\0' || errno != 0) {
+    fprintf(stderr, "printf: %s: %s\n", s,
+            errno == ERANGE ? strerror(errno) : "expected a numeric value");
+    printf_status = 1;
+  }
+  return n;
+}
+
+static long double printf_float(const char *s) {
+  char *end;
+  long double n;
+
+  if(*s == '\0')
+    return 0;
+  if(*s == '\'' || *s == '"')
+    return (unsigned char)s[1];
+  errno = 0;
+  n = strtold(s, &end);
+  if(*end != '\0' || errno != 0) {
+    fprintf(stderr, "printf: %s: expected a numeric value\n", s);
+    printf_status = 1;
+  }
+  return n;
+}
+
+// Takes the next argument, "" when there are none left
+static const char *next_arg(char ***args, int *nargs, int *used) {
+  if(*nargs == 0)
+    return "";
+  (*nargs)--;
+  (*used)++;
+  return *(*args)++;
+}
+
+/*
+ * Prints the format once, taking arguments from *args
+ * Returns 1 if \c stopped the output.
+ */
+static int print_format(const char *format, char ***args, int *nargs, int *used) {
+  char spec[64];
+  const char *p, *start;
+  const char *arg;
+  int len, stop = 0;
+  int star[2], nstar;
+
+  for(p = format; *p != '\0' && !stop; p++) {
+    if(*p == '\\') {
+      p += print_escape(p + 1, 0, &stop);
+      continue;
+    }
+    if(*p != '%') {
+      putchar(*p);
+      continue;
+    }
+    if(p[1] == '%') {
+      putchar('%');
+      p++;
+      continue;
+    }
+
+    // %[flags][width][.precision][length]conversion
+    start = p++;
+    nstar = 0;
+    p += strspn(p, "-+ #0'");
+    if(*p == '*') {
+      star[nstar++] = (int)printf_integer(next_arg(args, nargs, used), 0);
+      p++;
+    } else {
+      p += strspn(p, "0123456789");
+    }
+    if(*p == '.') {
+      p++;
+      if(*p == '*') {
+        star[nstar++] = (int)printf_integer(next_arg(args, nargs, used), 0);
+        p++;
+      } else {
+        p += strspn(p, "0123456789");
+      }
+    }
+    len = p - start;
+    p += strspn(p, "hlLqjzt");
+    if(*p == '\0' || len > (int)sizeof(spec) - 4 || strchr("diouxXeEfFgGaAcsb", *p) == NULL) {
+      fprintf(stderr, "printf: %.*s: invalid conversion specification\n",
+              (int)(p - start + (*p != '\0')), start);
+      printf_status = 1;
+      return 1;
+    }
+    memcpy(spec, start, len);
+
+    arg = next_arg(args, nargs, used);
+
+    switch(*p) {
+    case 'd':
+    case 'i':
+      strcpy(spec + len, "jd");
+      if(nstar == 2)
+        printf(spec, star[0], star[1], printf_integer(arg, 0));
+      else if(nstar == 1)
+        printf(spec, star[0], printf_integer(arg, 0));
+      else
+        printf(spec, printf_integer(arg, 0));
+      break;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      spec[len] = 'j';
+      spec[len + 1] = *p;
+      spec[len + 2] = '\0';
+      if(nstar == 2)
+        printf(spec, star[0], star[1], (uintmax_t)printf_integer(arg, 1));
+      else if(nstar == 1)
+        printf(spec, star[0], (uintmax_t)printf_integer(arg, 1));
+      else
+        printf(spec, (uintmax_t)printf_integer(arg, 1));
+      break;
+    case 'c':
+      spec[len] = 'c';
+      spec[len + 1] = '\0';
+      if(nstar == 2)
+        printf(spec, star[0], star[1], arg[0]);
+      else if(nstar == 1)
+        printf(spec, star[0], arg[0]);
+      else
+        printf(spec, arg[0]);
+      break;
+    case 's':
+      spec[len] = 's';
+      spec[len + 1] = '\0';
+      if(nstar == 2)
+        printf(spec, star[0], star[1], arg);
+      else if(nstar == 1)
+        printf(spec, star[0], arg);
+      else
+        printf(spec, arg);
+      break;
+    case 'b':
+      print_escaped(arg, &stop);
+      break;
+    default:
+      spec[len] = 'L';
+      spec[len + 1] = *p;
+      spec[len + 2] = '\0';
+      if(nstar == 2)
+        printf(spec, star[0], star[1], printf_float(arg));
+      else if(nstar == 1)
+        printf(spec, star[0], printf_float(arg));
+      else
+        printf(spec, printf_float(arg));
+      break;
+    }
+  }
+  return stop;
+}
+
+// printf format [argument...]
+// The format is used again while arguments are left
+int util_printf(int argc, char *argv[]) {
+  char **args = argv + 2;
+  int nargs = argc - 2;
+  int used;
+
+  if(argc < 2) {
+    fprintf(stderr, "printf: missing operand\n");
+    return 1;
+  }
+  printf_status = 0;
+  do {
+    used = 0;
+    if(print_format(argv[1], &args, &nargs, &used))
+      break;
+  } while(nargs > 0 && used > 0);
+  return printf_status;
+}
+
+/*
+ * basename and dirname
+ */
+
+// Options common to both: -z ends each line with a NUL
+// Returns the index of the first operand, -1 on a bad option
+static int path_options(int argc, char *argv[], const char *options, int *zero,
+                        int *multiple, const char **suffix) {
+  int i;
+  const char *o;
+
+  for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    if(!strcmp(argv[i], "--"))
+      return i + 1;
+    for(o = argv[i] + 1; *o != '\0'; o++) {
+      if(strchr(options, *o) == NULL) {
+        fprintf(stderr, "%s: invalid option -- '%c'\n", argv[0], *o);
+        return -1;
+      }
+      if(*o == 'z') {
+        *zero = 1;
+      } else if(*o == 'a') {
+        *multiple = 1;
+      } else if(*o == 's') {
+        *multiple = 1;
+        if(o[1] != '\0') {
+          *suffix = o + 1;
+        } else if(i + 1 < argc) {
+          *suffix = argv[++i];
+        } else {
+          fprintf(stderr, "%s: option requires an argument -- 's'\n", argv[0]);
+          return -1;
+        }
+        break;
+      }
+    }
+  }
+  return i;
+}
+
+static void print_base(const char *name, const char *suffix, int zero) {
+  int len = strlen(name), start, slen;
+
+  // trailing slashes are not part of the name
+  while(len > 1 && name[len - 1] == '/')
+    len--;
+  start = len;
+  while(start > 0 && name[start - 1] != '/')
+    start--;
+  if(len == 1 && name[0] == '/')
+    start = 0;
+
+  if(suffix != NULL) {
+    slen = strlen(suffix);
+    if(slen > 0 && slen < len - start && !strncmp(name + len - slen, suffix, slen))
+      len -= slen;
+  }
+  fwrite(name + start, 1, len - start, stdout);
+  putchar(zero ? '\0' : '\n');
+}
+
+// basename name [suffix], basename -a|-s suffix name...
+int util_basename(int argc, char *argv[]) {
+  const char *suffix = NULL;
+  int zero = 0, multiple = 0;
+  int i;
+
+  i = path_options(argc, argv, "asz", &zero, &multiple, &suffix);
+  if(i < 0)
+    return 1;
+  if(i >= argc) {
+    fprintf(stderr, "basename: missing operand\n");
+    return 1;
+  }
+
+  if(!multiple) {
+    if(argc - i > 2) {
+      fprintf(stderr, "basename: extra operand '%s'\n", argv[i + 2]);
+      return 1;
+    }
+    print_base(argv[i], argc - i == 2 ? argv[i + 1] : NULL, zero);
+    return 0;
+  }
+  for(; i < argc; i++)
+    print_base(argv[i], suffix, zero);
+  return 0;
+}
+
+static void print_dir(const char *name, int zero) {
+  int len = strlen(name);
+
+  // drop trailing slashes, then the last component, then the slashes
+  // before it
+  while(len > 1 && name[len - 1] == '/')
+    len--;
+  while(len > 0 && name[len - 1] != '/')
+    len--;
+  while(len > 1 && name[len - 1] == '/')
+    len--;
+
+  if(len == 0)
+    fputs(".", stdout);
+  else
+    fwrite(name, 1, len, stdout);
+  putchar(zero ? '\0' : '\n');
+}
+
+// dirname name...
+int util_dirname(int argc, char *argv[]) {
+  int zero = 0, multiple = 0;
+  const char *suffix = NULL;
+  int i;
+
+  i = path_options(argc, argv, "z", &zero, &multiple, &suffix);
+  if(i < 0)
+    return 1;
+  if(i >= argc) {
+    fprintf(stderr, "dirname: missing operand\n");
+    return 1;
+  }
+  for(; i < argc; i++)
+    print_dir(argv[i], zero);
+  return 0;
+}
+
+/*........................ end of utils.c ...................................*/
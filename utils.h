@@ -0,0 +1,18 @@
+/******************************************************************************
+ *
+ *  File Name........: utils.h
+ *
+ *  Description......: header file for the utilities built into ush.
+ *
+ *****************************************************************************/
+
+#ifndef UTILS_H
+#define UTILS_H
+
+int util_test(int argc, char *argv[]);
+int util_printf(int argc, char *argv[]);
+int util_basename(int argc, char *argv[]);
+int util_dirname(int argc, char *argv[]);
+
+#endif /* UTILS_H */
+/*........................ end of utils.h ...................................*/